@@ -1,207 +1,7879 @@
 #include <iostream>
 #include <vector>
+#include <map>
 #include <thread>
 #include <atomic>
 #include <random>
 #include <chrono>
 #include <mutex>
+#include <condition_variable>
+#include <future>
+#include <string>
+#include <stdexcept>
+#include <memory>
+#include <new>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <cstdio>
+#include <cmath>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#define STOCK_ENGINE_HAS_RECVMMSG 1
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <csignal>
+#define STOCK_ENGINE_HAS_MMAP 1
+#define STOCK_ENGINE_HAS_POSIX_IO 1
+#endif
+
+/*
+ * Side of the book an order belongs to.
+ */
+
+enum class Side : uint8_t {
+    Buy,
+    Sell
+};
+
+constexpr Side opposite_side(Side side) {
+    return side == Side::Buy ? Side::Sell : Side::Buy;
+}
+
+/*
+ * Prices are fixed-point integers counted in ticks of 1/price_scale dollars,
+ * so equal prices always land on the same level.
+ */
+
+using Price = int64_t;
+constexpr Price price_scale = 100;
+
+inline Price to_ticks(double price) {
+    return static_cast<Price>(std::llround(price * price_scale));
+}
+
+// Renders a tick price as dollars, e.g. 20050 -> "200.50".
+inline std::string format_price(Price price) {
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%lld.%02lld",
+                  static_cast<long long>(price / price_scale), static_cast<long long>(price % price_scale));
+    return buffer;
+}
+
+/*
+ * What an order does with the quantity it cannot fill on arrival.
+ * - Limit rests the remainder at its limit price.
+ * - ImmediateOrCancel fills whatever crosses its limit and drops the rest.
+ * - FillOrKill fills completely within its limit or does nothing at all.
+ * - Market ignores its price, fills against any level and drops the rest.
+ * Only Limit orders ever rest in a book.
+ */
+
+enum class OrderType : uint8_t {
+    Limit,
+    ImmediateOrCancel,
+    FillOrKill,
+    Market
+};
 
 /*
  * Order class represents a stock market order (Buy or Sell).
- * It contains essential attributes such as order type, ticker symbol,
- * quantity of shares, price per share, and a unique order ID.
- * This class is used as the fundamental unit of stock transactions.
+ * It contains essential attributes such as order side, ticker symbol,
+ * quantity of shares, price per share in ticks, a unique order ID and
+ * its order type.
+ * This class is used as the fundamental unit of stock transactions and is
+ * kept trivially copyable so it can be moved around as plain memory.
  */
 
 class Order {
 public:
-    // "Buy" or "Sell"
-    std::string order_type;
-    int ticker;
-    int quantity;
-    double price;
-    int order_id;
-    
-    Order(std::string type, int tick, int qty, double prc, int id)
-        : order_type(type), ticker(tick), quantity(qty), price(prc), order_id(id) {}
+    uint64_t order_id;
+    Price price;
+    uint32_t quantity;
+    int32_t ticker;
+    Side side;
+    OrderType type;
+
+    Order() = default;
+    Order(Side sd, int32_t tick, uint32_t qty, Price prc, uint64_t id, OrderType typ = OrderType::Limit)
+        : order_id(id), price(prc), quantity(qty), ticker(tick), side(sd), type(typ) {}
 };
 
+static_assert(std::is_trivially_copyable<Order>::value, "Order must stay trivially copyable");
+static_assert(sizeof(Order) <= 32, "Order must fit in half a cache line");
+
 /*
- * Node class serves as an element of the priority queue.
- * Each node holds an order and a pointer to the next node,
- * forming a linked list-based priority queue.
+ * Node class serves as an element of a price level.
+ * Each node holds an order and pointers to its neighbours, forming the
+ * doubly-linked FIFO of orders resting at one price level so any node
+ * can be unlinked in O(1).
  */
 
 class Node {
 public:
     Order order;
+    Node* prev;
     Node* next;
 
-    Node(Order ord) : order(ord), next(nullptr) {}
+    Node(Order ord) : order(ord), prev(nullptr), next(nullptr) {}
 };
 
 /*
- * PriorityQueue implements a sorted linked list acting as a priority queue.
- * It maintains orders in a sorted fashion based on price priority.
- * - Buy orders are stored in a max-heap fashion (higher price = higher priority).
- * - Sell orders are stored in a min-heap fashion (lower price = higher priority).
- * This structure allows O(n) insertion but ensures the highest-priority order
- * is accessible in O(1) time.
+ * NodePool is a slab allocator with an intrusive free list for Node objects.
+ * - Nodes are carved out of fixed-size slabs and recycled through the free list,
+ *   so steady-state order flow never reaches the global allocator.
+ * - Capacity can be reserved up front to make memory use predictable.
+ * - It counts live nodes and every allocate/release (churn), so owners can account
+ *   for its memory and tell a quiet pool from a busy one.
+ * A pool is not thread-safe; each ticker owns one and guards it with the ticker lock.
  */
 
-class PriorityQueue {
+class NodePool {
 private:
-    Node* head;
-    bool is_max_heap;
+    union Slot {
+        Slot* next_free;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    static constexpr size_t slab_size = 256;
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    Slot* free_list;
+    size_t capacity;
+    size_t live;
+    uint64_t churn;
+
+    void add_slab(size_t count) {
+        std::unique_ptr<Slot[]> slab(new Slot[count]);
+        for (size_t i = 0; i < count; i++) {
+            slab[i].next_free = (i + 1 < count) ? &slab[i + 1] : free_list;
+        }
+        free_list = &slab[0];
+        capacity += count;
+        slabs.push_back(std::move(slab));
+    }
 
 public:
-    PriorityQueue(bool max_heap) : head(nullptr), is_max_heap(max_heap) {}
+    explicit NodePool(size_t initial_capacity = 0) : free_list(nullptr), capacity(0), live(0), churn(0) {
+        reserve(initial_capacity);
+    }
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+    NodePool(NodePool&&) = default;
+    // Frees this pool's slabs; only valid once none of its nodes are referenced.
+    NodePool& operator=(NodePool&&) = default;
+
+    // Grow the pool so that at least the given number of nodes exist.
+    void reserve(size_t count) {
+        if (count > capacity) {
+            add_slab(count - capacity);
+        }
+    }
 
-    void insert(Order order) {
-        Node* new_node = new Node(order);
-        if (!head || (is_max_heap && order.price > head->order.price) || (!is_max_heap && order.price < head->order.price)) {
-            new_node->next = head;
-            head = new_node;
+    Node* allocate(const Order& order) {
+        if (!free_list) {
+            add_slab(slab_size);
+        }
+        Slot* slot = free_list;
+        free_list = slot->next_free;
+        live++;
+        churn++;
+        return new (slot->storage) Node(order);
+    }
+
+    void release(Node* node) {
+        node->~Node();
+        Slot* slot = reinterpret_cast<Slot*>(node);
+        slot->next_free = free_list;
+        free_list = slot;
+        live--;
+        churn++;
+    }
+
+    size_t node_capacity() const {
+        return capacity;
+    }
+
+    size_t live_nodes() const {
+        return live;
+    }
+
+    uint64_t churn_count() const {
+        return churn;
+    }
+
+    // Heap bytes held by the slabs and their table.
+    size_t bytes() const {
+        return capacity * sizeof(Slot) + slabs.capacity() * sizeof(slabs[0]);
+    }
+
+    static constexpr size_t nodes_per_slab() {
+        return slab_size;
+    }
+};
+
+/*
+ * PriceLevel holds every resting order at a single price.
+ * Orders at the level form an intrusive FIFO (head = oldest, tail = newest),
+ * so time priority within a price is strict. The level also keeps its
+ * aggregate quantity and order count so depth can be read without walking the FIFO.
+ */
+
+struct PriceLevel {
+    Price price;
+    Node* head;
+    Node* tail;
+    // Total resting quantity and number of orders at this price.
+    uint64_t quantity;
+    uint32_t order_count;
+};
+
+// Replaces every node of a level with move(node), keeping FIFO order, for pool compaction.
+template <typename Relocate>
+void relocate_level(PriceLevel& level, Relocate& move) {
+    Node* previous = nullptr;
+    for (Node* node = level.head; node;) {
+        Node* next = node->next;
+        Node* moved = move(node);
+        moved->prev = previous;
+        moved->next = nullptr;
+        if (previous) {
+            previous->next = moved;
         } else {
-            Node* current = head;
-            while (current->next && ((is_max_heap && current->next->order.price > order.price) || (!is_max_heap && current->next->order.price < order.price))) {
-                current = current->next;
-            }
-            new_node->next = current->next;
-            current->next = new_node;
+            level.head = moved;
         }
+        previous = moved;
+        node = next;
     }
+    level.tail = previous;
+}
 
-    Order pop() {
-        if (!head) throw std::runtime_error("Queue is empty");
-        Node* temp = head;
-        Order ord = head->order;
-        head = head->next;
-        delete temp;
-        return ord;
+/*
+ * DepthUpdate is one incremental L2 change: a price level was added, changed
+ * or deleted on one side of a ticker. sequence increases by one per update
+ * for each ticker, so consumers can detect gaps.
+ */
+
+enum class DepthAction : uint8_t {
+    Add,
+    Change,
+    Delete
+};
+
+struct DepthUpdate {
+    uint64_t sequence;
+    Price price;
+    uint64_t quantity;
+    uint32_t order_count;
+    int32_t ticker;
+    Side side;
+    DepthAction action;
+};
+
+class DepthFeed;
+
+/*
+ * DepthEmitter turns price level changes on one ticker into DepthUpdates.
+ * It is shared by the ticker's buy and sell books and only used under the ticker
+ * lock; with no feed attached it does nothing.
+ */
+
+struct DepthEmitter {
+    DepthFeed* feed = nullptr;
+    int32_t ticker = 0;
+    uint64_t sequence = 0;
+
+    void emit(DepthAction action, Side side, const PriceLevel& level);
+};
+
+/*
+ * LevelSlab is the tree-node allocator behind one PriceLevelBook.
+ * - std::map nodes are carved out of small slabs and recycled through an intrusive
+ *   free list, so opening and closing levels in steady state never reaches the
+ *   global allocator.
+ * - A side's levels sit together in a few slabs instead of wherever the global
+ *   allocator put them, which keeps tree searches and matching in cache.
+ * Every allocation has the size of the first one. Like NodePool it is not thread-safe;
+ * the ticker lock guards it.
+ */
+
+class LevelSlab {
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    static constexpr size_t slots_per_slab = 32;
+    std::vector<std::unique_ptr<unsigned char[]>> slabs;
+    FreeSlot* free_list = nullptr;
+    size_t slot_bytes = 0;
+
+    static size_t slot_size_for(size_t bytes) {
+        size_t align = alignof(std::max_align_t);
+        return (std::max(bytes, sizeof(FreeSlot)) + align - 1) / align * align;
     }
 
-    Order* peek() {
-        return head ? &head->order : nullptr;
+    void add_slab() {
+        std::unique_ptr<unsigned char[]> slab(new unsigned char[slot_bytes * slots_per_slab]);
+        for (size_t i = slots_per_slab; i-- > 0;) {
+            FreeSlot* slot = reinterpret_cast<FreeSlot*>(slab.get() + i * slot_bytes);
+            slot->next = free_list;
+            free_list = slot;
+        }
+        slabs.push_back(std::move(slab));
+    }
+
+public:
+    LevelSlab() = default;
+    LevelSlab(const LevelSlab&) = delete;
+    LevelSlab& operator=(const LevelSlab&) = delete;
+
+    // Whether objects of this size come from the slabs.
+    bool serves(size_t bytes) const {
+        return slot_bytes == 0 || slot_size_for(bytes) == slot_bytes;
+    }
+
+    void* allocate(size_t bytes) {
+        if (slot_bytes == 0) {
+            slot_bytes = slot_size_for(bytes);
+        }
+        if (!free_list) {
+            add_slab();
+        }
+        FreeSlot* slot = free_list;
+        free_list = slot->next;
+        return slot;
+    }
+
+    void release(void* memory) {
+        FreeSlot* slot = static_cast<FreeSlot*>(memory);
+        slot->next = free_list;
+        free_list = slot;
+    }
+
+    // Heap bytes held by the slabs and their table.
+    size_t bytes() const {
+        return slabs.size() * slots_per_slab * slot_bytes + slabs.capacity() * sizeof(slabs[0]);
+    }
+};
+
+// Standard allocator adapter that takes single objects from a LevelSlab.
+template <typename T>
+class LevelAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    LevelSlab* slab;
+
+    explicit LevelAllocator(LevelSlab* level_slab) noexcept : slab(level_slab) {}
+
+    template <typename U>
+    LevelAllocator(const LevelAllocator<U>& other) noexcept : slab(other.slab) {}
+
+    T* allocate(size_t count) {
+        if (count == 1 && slab->serves(sizeof(T))) {
+            return static_cast<T*>(slab->allocate(sizeof(T)));
+        }
+        return static_cast<T*>(::operator new(count * sizeof(T)));
+    }
+
+    void deallocate(T* memory, size_t count) {
+        if (count == 1 && slab->serves(sizeof(T))) {
+            slab->release(memory);
+        } else {
+            ::operator delete(memory);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const LevelAllocator<U>& other) const {
+        return slab == other.slab;
     }
 
-    bool is_empty() {
-        return head == nullptr;
+    template <typename U>
+    bool operator!=(const LevelAllocator<U>& other) const {
+        return slab != other.slab;
     }
 };
 
 /*
- * OrderBook class manages stock transactions and order matching.
- * - It maintains two priority queues per stock ticker (one for buy orders, one for sell orders).
- * - Uses a lock-free approach with atomic spinlocks to handle concurrent access.
- * - Orders are added to the respective queue and matched in real-time if conditions allow.
+ * PriceLevelBook holds one side (Buy or Sell) of a single ticker's book.
+ * - Levels live in a red-black tree (std::map) ordered from best to worst price, so
+ *   the best level is begin() and opening or closing a level is O(log levels)
+ *   wherever it sits in the book.
+ * - Tree nodes come from the side's own LevelSlab, so levels stay close together in
+ *   memory and steady-state flow that opens and closes levels never allocates.
+ * - The side is a template parameter: Buy books treat higher prices as better,
+ *   Sell books lower, and each side compiles to its own comparison with no
+ *   runtime side check in the search or matching loops.
+ * Insertion costs O(log levels) to find the level plus an O(1) append to its FIFO,
+ * removing an order costs the same, and the best order is accessible in O(1) time.
  */
 
-class OrderBook {
+template <Side BookSide>
+class PriceLevelBook {
+public:
+    // True if price a has strictly higher priority than price b on this side.
+    static constexpr bool better(Price a, Price b) {
+        if constexpr (BookSide == Side::Buy) {
+            return a > b;
+        } else {
+            return a < b;
+        }
+    }
+
 private:
-    static constexpr int max_tickers = 1024;
-    std::vector<PriorityQueue> buy_orders;
-    std::vector<PriorityQueue> sell_orders;
-    std::vector<std::atomic_flag> locks;
-    std::atomic<int> order_id_counter;
+    struct BetterFirst {
+        bool operator()(Price a, Price b) const {
+            return better(a, b);
+        }
+    };
+
+    using Levels = std::map<Price, PriceLevel, BetterFirst, LevelAllocator<std::pair<const Price, PriceLevel>>>;
+
+    // Declared before levels so it outlives the tree.
+    std::unique_ptr<LevelSlab> slab;
+    Levels levels;
+    NodePool* pool;
+    DepthEmitter* depth;
+
+    void emit(DepthAction action, const PriceLevel& level) {
+        if (depth->feed) {
+            depth->emit(action, BookSide, level);
+        }
+    }
+
+    // Opens a level for the order's price just before hint and returns it.
+    PriceLevel& open_level(typename Levels::iterator hint, Price price, Node* node, uint32_t quantity) {
+        return levels.emplace_hint(hint, price, PriceLevel{price, node, node, quantity, 1})->second;
+    }
+
+    void close_level(typename Levels::iterator it) {
+        emit(DepthAction::Delete, it->second);
+        levels.erase(it);
+    }
+
+    static void append(PriceLevel& level, Node* node) {
+        node->prev = level.tail;
+        level.tail->next = node;
+        level.tail = node;
+        level.quantity += node->order.quantity;
+        level.order_count++;
+    }
 
 public:
-    OrderBook() : order_id_counter(0), buy_orders(max_tickers, PriorityQueue(true)), sell_orders(max_tickers, PriorityQueue(false)), locks(max_tickers) {}
+    PriceLevelBook(NodePool* node_pool, DepthEmitter* depth_emitter)
+        : slab(new LevelSlab), levels(BetterFirst(), typename Levels::allocator_type(slab.get())),
+          pool(node_pool), depth(depth_emitter) {}
 
-    void add_order(std::string order_type, int ticker, int quantity, double price) {
-        int order_id = order_id_counter.fetch_add(1);
-        Order order(order_type, ticker, quantity, price, order_id);
-        int index = ticker % max_tickers;
-        
-        // Spinlock
-        while (locks[index].test_and_set(std::memory_order_acquire));
-        if (order_type == "Buy") {
-            buy_orders[index].insert(order);
+    PriceLevelBook(const PriceLevelBook&) = delete;
+    PriceLevelBook& operator=(const PriceLevelBook&) = delete;
+    // The tree keeps pointing at the same slab, whose ownership moves with it.
+    PriceLevelBook(PriceLevelBook&& other) noexcept
+        : slab(std::move(other.slab)), levels(std::move(other.levels)), pool(other.pool), depth(other.depth) {}
+
+    ~PriceLevelBook() {
+        for (auto& entry : levels) {
+            PriceLevel& level = entry.second;
+            while (level.head) {
+                Node* temp = level.head;
+                level.head = level.head->next;
+                pool->release(temp);
+            }
+        }
+    }
+
+    // Appends the order to the back of its price level and returns the node holding it.
+    Node* insert(Order order) {
+        Node* new_node = pool->allocate(order);
+        // Most orders join or improve the best level, which needs no tree search.
+        auto it = levels.begin();
+        if (it != levels.end() && better(it->first, order.price)) {
+            it = levels.lower_bound(order.price);
+        }
+        if (it == levels.end() || it->first != order.price) {
+            emit(DepthAction::Add, open_level(it, order.price, new_node, order.quantity));
+        } else {
+            append(it->second, new_node);
+            emit(DepthAction::Change, it->second);
+        }
+        return new_node;
+    }
+
+    Order pop() {
+        if (levels.empty()) throw std::runtime_error("Queue is empty");
+        auto best_it = levels.begin();
+        PriceLevel& best = best_it->second;
+        Node* temp = best.head;
+        Order ord = temp->order;
+        best.head = temp->next;
+        best.quantity -= ord.quantity;
+        best.order_count--;
+        if (best.head) {
+            best.head->prev = nullptr;
+            emit(DepthAction::Change, best);
         } else {
-            sell_orders[index].insert(order);
+            close_level(best_it);
         }
-        locks[index].clear(std::memory_order_release);
-        
-        match_order(ticker);
+        pool->release(temp);
+        return ord;
     }
 
     /*
-     * Match buy and sell orders for a given ticker.
-     * - The best buy order is executed against the best sell order if the price conditions match.
-     * - If only part of the order can be fulfilled, the remaining shares are reinserted into the queue.
+     * Bulk-load path for restores: orders must arrive from the worst level to the
+     * best and oldest-first within a level, so each one lands at begin() and costs
+     * amortized O(1). Returns nullptr if the order would break that ordering.
      */
+    Node* append_worst_to_best(const Order& order) {
+        if (!levels.empty() && better(levels.begin()->first, order.price)) {
+            return nullptr;
+        }
+        Node* new_node = pool->allocate(order);
+        if (levels.empty() || levels.begin()->first != order.price) {
+            emit(DepthAction::Add, open_level(levels.begin(), order.price, new_node, order.quantity));
+        } else {
+            append(levels.begin()->second, new_node);
+            emit(DepthAction::Change, levels.begin()->second);
+        }
+        return new_node;
+    }
 
-    void match_order(int ticker) {
-        int index = ticker % max_tickers;
-        // Spinlock
-        while (locks[index].test_and_set(std::memory_order_acquire));
-        while (!buy_orders[index].is_empty() && !sell_orders[index].is_empty()) {
-            Order* best_buy = buy_orders[index].peek();
-            Order* best_sell = sell_orders[index].peek();
-            
-            if (best_buy->price >= best_sell->price) {
-                Order executed_buy = buy_orders[index].pop();
-                Order executed_sell = sell_orders[index].pop();
-                
-                int trade_quantity = std::min(executed_buy.quantity, executed_sell.quantity);
-                executed_buy.quantity -= trade_quantity;
-                executed_sell.quantity -= trade_quantity;
-                
-                std::cout << "Trade Executed: " << trade_quantity << " shares of Ticker " << ticker << " at $" << executed_sell.price << std::endl;
-                
-                if (executed_buy.quantity > 0) {
-                    buy_orders[index].insert(executed_buy);
-                }
-                if (executed_sell.quantity > 0) {
-                    sell_orders[index].insert(executed_sell);
-                }
-            } else {
-                break;
+    // Visits up to max_levels levels from the best price outwards.
+    template <typename Visitor>
+    void for_each_level_best_first(size_t max_levels, Visitor visit) const {
+        size_t visited = 0;
+        for (auto it = levels.begin(); it != levels.end() && visited < max_levels; ++it, ++visited) {
+            visit(it->second);
+        }
+    }
+
+    /*
+     * Quantity resting at prices an opposite-side order limited at limit would trade
+     * against, summed from the best level and stopping once wanted is reached.
+     * Reads only level aggregates, so it costs O(levels touched).
+     */
+    uint64_t crossing_quantity(Price limit, uint64_t wanted) const {
+        uint64_t available = 0;
+        for (auto it = levels.begin(); it != levels.end() && available < wanted && !better(limit, it->first); ++it) {
+            available += it->second.quantity;
+        }
+        return available;
+    }
+
+    // Visits, best first, the levels an opposite-side order limited at limit would trade against.
+    template <typename Visitor>
+    void for_each_crossing_level(Price limit, Visitor visit) const {
+        for (auto it = levels.begin(); it != levels.end() && !better(limit, it->first); ++it) {
+            visit(it->second);
+        }
+    }
+
+    /*
+     * Moves every resting node to move(node), which returns its copy in another pool,
+     * and rebuilds the tree in a right-sized slab. Levels, FIFO order and depth are unchanged.
+     */
+    template <typename Relocate>
+    void relocate(Relocate& move) {
+        // Best level first, so the matcher's next nodes end up adjacent.
+        for (auto& entry : levels) {
+            relocate_level(entry.second, move);
+        }
+        std::unique_ptr<LevelSlab> packed(new LevelSlab);
+        Levels rebuilt(BetterFirst(), typename Levels::allocator_type(packed.get()));
+        for (const auto& entry : levels) {
+            rebuilt.emplace_hint(rebuilt.end(), entry.first, entry.second);
+        }
+        // The old tree frees its nodes into the old slab before that slab goes.
+        levels.swap(rebuilt);
+        rebuilt.clear();
+        slab.swap(packed);
+    }
+
+    size_t memory_bytes() const {
+        return slab->bytes();
+    }
+
+    // Visits every resting order from the worst level to the best, oldest-first within a level.
+    template <typename Visitor>
+    void for_each_worst_to_best(Visitor visit) const {
+        for (auto it = levels.rbegin(); it != levels.rend(); ++it) {
+            for (const Node* node = it->second.head; node; node = node->next) {
+                visit(node->order);
             }
         }
-        locks[index].clear(std::memory_order_release);
+    }
+
+    // Unlinks a resting node from anywhere in the book and returns it to the pool.
+    void remove(Node* node) {
+        auto it = levels.find(node->order.price);
+        PriceLevel& level = it->second;
+        level.quantity -= node->order.quantity;
+        level.order_count--;
+        if (node->prev) {
+            node->prev->next = node->next;
+        } else {
+            level.head = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        } else {
+            level.tail = node->prev;
+        }
+        if (!level.head) {
+            close_level(it);
+        } else {
+            emit(DepthAction::Change, level);
+        }
+        pool->release(node);
+    }
+
+    /*
+     * Trades quantity off the best order in place; it keeps its place in the FIFO.
+     * A fully filled order must be pop()ed next, which reports the level change,
+     * so no depth update is emitted for it here.
+     */
+    void fill_best(uint32_t quantity) {
+        PriceLevel& best = levels.begin()->second;
+        best.head->order.quantity -= quantity;
+        best.quantity -= quantity;
+        if (best.head->order.quantity > 0) {
+            emit(DepthAction::Change, best);
+        }
+    }
+
+    // Lowers a resting order's quantity in place without losing time priority.
+    void reduce(Node* node, uint32_t quantity) {
+        PriceLevel& level = levels.find(node->order.price)->second;
+        level.quantity -= node->order.quantity - quantity;
+        node->order.quantity = quantity;
+        emit(DepthAction::Change, level);
+    }
+
+    Order* peek() {
+        return levels.empty() ? nullptr : &levels.begin()->second.head->order;
+    }
+
+    // Price and aggregate quantity of the best level; only valid when the book is not empty.
+    const PriceLevel& best_level() const {
+        return levels.begin()->second;
+    }
+
+    bool is_empty() const {
+        return levels.empty();
+    }
+
+    size_t level_count() const {
+        return levels.size();
+    }
+
+    // Every price can rest here; see PriceLadderBook for a bounded book.
+    static constexpr bool in_band(Price) {
+        return true;
+    }
+
+    static constexpr bool in_band_without(Price, const Node*) {
+        return true;
     }
 };
 
-OrderBook order_book;
+// Width in ticks of each PriceLadderBook band; override with -DSTOCK_ENGINE_LADDER_TICKS=N.
+#ifndef STOCK_ENGINE_LADDER_TICKS
+#define STOCK_ENGINE_LADDER_TICKS 4096
+#endif
 
 /*
- * Simulates real-time stock transactions with random orders.
- * - Creates buy/sell orders with random prices and quantities.
- * - Runs continuously with multiple threads to mimic real-world order flow.
+ * PriceLadderBook is a dense alternative to PriceLevelBook for liquid tickers
+ * that trade in a bounded price band.
+ * - Every tick of the band has its own PriceLevel slot and an occupancy bitmap marks
+ *   the non-empty ones, so resting at any price is O(1) with no level shifting.
+ * - When the best level empties, the next one is found by scanning the bitmap:
+ *   AVX-512 or AVX2 (when compiled for them) skip 8 or 4 empty words per test,
+ *   then tzcnt/lzcnt locate the level inside a word. A sweep through many levels is a
+ *   few bitmap scans, not a chain of pointer chases.
+ * - The band is centered on the first price that rests on an empty side, and moves
+ *   whenever the side empties again. in_band() tells callers, before they touch the
+ *   book, whether a price could rest.
+ * It has the same interface as PriceLevelBook, so either one can back an OrderBook.
  */
 
-void simulate_market_activity(int iterations) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> ticker_dist(0, 1023);
-    std::uniform_int_distribution<> quantity_dist(1, 100);
-    std::uniform_real_distribution<> price_dist(10.0, 500.0);
-    std::uniform_int_distribution<> type_dist(0, 1);
+template <Side BookSide>
+class PriceLadderBook {
+public:
+    static constexpr size_t ticks = STOCK_ENGINE_LADDER_TICKS;
+    static_assert(ticks >= 512 && ticks % 512 == 0, "ladder width must be a multiple of 512 ticks");
 
-    for (int i = 0; i < iterations; i++) {
-        std::string order_type = type_dist(gen) ? "Buy" : "Sell";
-        int ticker = ticker_dist(gen);
-        int quantity = quantity_dist(gen);
-        double price = price_dist(gen);
-        order_book.add_order(order_type, ticker, quantity, price);
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+private:
+    static constexpr size_t words = ticks / 64;
+    static constexpr size_t none = ~size_t(0);
+
+    // Allocated when the side first holds an order.
+    std::unique_ptr<PriceLevel[]> ladder;
+    std::unique_ptr<uint64_t[]> occupancy;
+    Price base = 0;
+    size_t best = none;
+    size_t occupied = 0;
+    NodePool* pool;
+    DepthEmitter* depth;
+
+    void emit(DepthAction action, const PriceLevel& level) {
+        if (depth->feed) {
+            depth->emit(action, BookSide, level);
+        }
     }
-}
 
-/*
- * Main function launches multiple threads to simulate live trading.
- * - Each thread processes 500 random stock orders.
- * - Ensures concurrent access and execution of trades.
- */
+    // True if every word in [word, word + count) is zero.
+    bool words_empty(size_t word, size_t count) const {
+#if defined(__AVX512F__)
+        if (count == 8) {
+            __m512i bits = _mm512_loadu_si512(occupancy.get() + word);
+            return _mm512_test_epi64_mask(bits, bits) == 0;
+        }
+#endif
+#if defined(__AVX2__)
+        if (count >= 4) {
+            for (size_t i = 0; i < count; i += 4) {
+                __m256i bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(occupancy.get() + word + i));
+                if (!_mm256_testz_si256(bits, bits)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+#endif
+        for (size_t i = 0; i < count; i++) {
+            if (occupancy[word + i]) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-int main() {
-    std::vector<std::thread> threads;
-    for (int i = 0; i < 4; i++) {
-        threads.emplace_back(simulate_market_activity, 500);
+    // Lowest occupied slot at or above from, or none.
+    size_t scan_up(size_t from) const {
+        size_t word = from >> 6;
+        uint64_t bits = occupancy[word] & (~uint64_t(0) << (from & 63));
+        while (!bits) {
+            if (++word == words) {
+                return none;
+            }
+            // Skip whole empty 512-bit blocks once aligned to one.
+            while (word % 8 == 0 && word + 8 <= words && words_empty(word, 8)) {
+                word += 8;
+                if (word == words) {
+                    return none;
+                }
+            }
+            bits = occupancy[word];
+        }
+        return (word << 6) + static_cast<size_t>(__builtin_ctzll(bits));
     }
-    for (auto& t : threads) {
-        t.join();
+
+    // Highest occupied slot at or below from, or none.
+    size_t scan_down(size_t from) const {
+        size_t word = from >> 6;
+        uint64_t bits = occupancy[word] & (~uint64_t(0) >> (63 - (from & 63)));
+        while (!bits) {
+            if (word == 0) {
+                return none;
+            }
+            --word;
+            while ((word + 1) % 8 == 0 && word >= 7 && words_empty(word - 7, 8)) {
+                if (word == 7) {
+                    return none;
+                }
+                word -= 8;
+            }
+            bits = occupancy[word];
+        }
+        return (word << 6) + 63 - static_cast<size_t>(__builtin_clzll(bits));
     }
-    return 0;
+
+    // Next slot from the given one towards worse prices (inclusive), or none.
+    size_t next_worse(size_t from) const {
+        if constexpr (BookSide == Side::Buy) {
+            return scan_down(from);
+        } else {
+            return scan_up(from);
+        }
+    }
+
+    // Next slot from the given one towards better prices (inclusive), or none.
+    size_t next_better(size_t from) const {
+        if constexpr (BookSide == Side::Buy) {
+            return scan_up(from);
+        } else {
+            return scan_down(from);
+        }
+    }
+
+    size_t slot_of(Price price) const {
+        return static_cast<size_t>(price - base);
+    }
+
+    // Forgets a level that just emptied and finds the new best if it was the best.
+    void vacate(size_t slot) {
+        emit(DepthAction::Delete, ladder[slot]);
+        occupancy[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+        ladder[slot].head = ladder[slot].tail = nullptr;
+        if (--occupied == 0) {
+            best = none;
+        } else if (slot == best) {
+            best = next_worse(slot);
+        }
+    }
+
+    // Places the band at [band_base, band_base + ticks); the side must be empty.
+    void anchor(Price band_base) {
+        if (!ladder) {
+            ladder.reset(new PriceLevel[ticks]());
+            occupancy.reset(new uint64_t[words]());
+        }
+        base = band_base;
+    }
+
+    // Rests an order inside the current band.
+    Node* place(const Order& order) {
+        if (order.price < base || order.price - base >= static_cast<Price>(ticks)) {
+            throw std::out_of_range("price outside the ticker's ladder band");
+        }
+        size_t slot = slot_of(order.price);
+        Node* new_node = pool->allocate(order);
+        PriceLevel& level = ladder[slot];
+        if (!level.head) {
+            level = PriceLevel{order.price, new_node, new_node, order.quantity, 1};
+            occupancy[slot >> 6] |= uint64_t(1) << (slot & 63);
+            if (occupied++ == 0 || better(order.price, ladder[best].price)) {
+                best = slot;
+            }
+            emit(DepthAction::Add, level);
+        } else {
+            new_node->prev = level.tail;
+            level.tail->next = new_node;
+            level.tail = new_node;
+            level.quantity += order.quantity;
+            level.order_count++;
+            emit(DepthAction::Change, level);
+        }
+        return new_node;
+    }
+
+    // Slot of the worst occupied level; the book must not be empty.
+    size_t worst_slot() const {
+        return BookSide == Side::Buy ? scan_up(0) : scan_down(ticks - 1);
+    }
+
+public:
+    static constexpr bool better(Price a, Price b) {
+        return PriceLevelBook<BookSide>::better(a, b);
+    }
+
+    PriceLadderBook(NodePool* node_pool, DepthEmitter* depth_emitter) : pool(node_pool), depth(depth_emitter) {}
+
+    PriceLadderBook(const PriceLadderBook&) = delete;
+    PriceLadderBook& operator=(const PriceLadderBook&) = delete;
+
+    ~PriceLadderBook() {
+        for (size_t slot = occupied ? scan_up(0) : none; slot != none; slot = slot + 1 < ticks ? scan_up(slot + 1) : none) {
+            while (ladder[slot].head) {
+                Node* temp = ladder[slot].head;
+                ladder[slot].head = temp->next;
+                pool->release(temp);
+            }
+        }
+    }
+
+    // True if an order at this price could rest: the side is empty or the price is inside the band.
+    bool in_band(Price price) const {
+        return occupied == 0 || (price >= base && price - base < static_cast<Price>(ticks));
+    }
+
+    // in_band once the resting node is removed: a side holding only that node re-anchors on insert.
+    bool in_band_without(Price price, const Node* node) const {
+        return (occupied == 1 && ladder[best].order_count == 1 && ladder[best].head == node) || in_band(price);
+    }
+
+    // Appends the order to the back of its price level and returns the node holding it.
+    Node* insert(Order order) {
+        if (occupied == 0) {
+            anchor(order.price - static_cast<Price>(ticks / 2));
+        }
+        return place(order);
+    }
+
+    Order pop() {
+        if (occupied == 0) throw std::runtime_error("Queue is empty");
+        PriceLevel& level = ladder[best];
+        Node* temp = level.head;
+        Order ord = temp->order;
+        level.head = temp->next;
+        level.quantity -= ord.quantity;
+        level.order_count--;
+        if (level.head) {
+            level.head->prev = nullptr;
+            emit(DepthAction::Change, level);
+        } else {
+            vacate(best);
+        }
+        pool->release(temp);
+        return ord;
+    }
+
+    /*
+     * Bulk-load helper with the same contract as PriceLevelBook::append_worst_to_best.
+     * The band starts at the first (worst) price instead of centering on it, so a
+     * side that fitted one band when it was saved fits again on load.
+     */
+    Node* append_worst_to_best(const Order& order) {
+        if (occupied == 0) {
+            anchor(BookSide == Side::Buy ? order.price : order.price - static_cast<Price>(ticks - 1));
+        } else if (better(ladder[best].price, order.price)) {
+            return nullptr;
+        }
+        return place(order);
+    }
+
+    // Visits up to max_levels levels from the best price outwards.
+    template <typename Visitor>
+    void for_each_level_best_first(size_t max_levels, Visitor visit) const {
+        size_t visited = 0;
+        for (size_t slot = best; slot != none && visited < max_levels; visited++) {
+            visit(ladder[slot]);
+            if (BookSide == Side::Buy ? slot == 0 : slot + 1 == ticks) {
+                break;
+            }
+            slot = next_worse(BookSide == Side::Buy ? slot - 1 : slot + 1);
+        }
+    }
+
+    // Same contract as PriceLevelBook::crossing_quantity, walking occupied slots through the bitmap.
+    uint64_t crossing_quantity(Price limit, uint64_t wanted) const {
+        uint64_t available = 0;
+        for (size_t slot = best; slot != none && available < wanted && !better(limit, ladder[slot].price);) {
+            available += ladder[slot].quantity;
+            if (BookSide == Side::Buy ? slot == 0 : slot + 1 == ticks) {
+                break;
+            }
+            slot = next_worse(BookSide == Side::Buy ? slot - 1 : slot + 1);
+        }
+        return available;
+    }
+
+    // Same contract as PriceLevelBook::for_each_crossing_level.
+    template <typename Visitor>
+    void for_each_crossing_level(Price limit, Visitor visit) const {
+        for (size_t slot = best; slot != none && !better(limit, ladder[slot].price);) {
+            visit(ladder[slot]);
+            if (BookSide == Side::Buy ? slot == 0 : slot + 1 == ticks) {
+                break;
+            }
+            slot = next_worse(BookSide == Side::Buy ? slot - 1 : slot + 1);
+        }
+    }
+
+    // As PriceLevelBook::relocate; an empty side also gives back its band arrays.
+    template <typename Relocate>
+    void relocate(Relocate& move) {
+        if (occupied == 0) {
+            ladder.reset();
+            occupancy.reset();
+            return;
+        }
+        for (size_t slot = best;;) {
+            relocate_level(ladder[slot], move);
+            if (BookSide == Side::Buy ? slot == 0 : slot + 1 == ticks) {
+                break;
+            }
+            slot = next_worse(BookSide == Side::Buy ? slot - 1 : slot + 1);
+            if (slot == none) {
+                break;
+            }
+        }
+    }
+
+    size_t memory_bytes() const {
+        return ladder ? ticks * sizeof(PriceLevel) + words * sizeof(uint64_t) : 0;
+    }
+
+    // Visits every resting order from the worst level to the best, oldest-first within a level.
+    template <typename Visitor>
+    void for_each_worst_to_best(Visitor visit) const {
+        for (size_t slot = occupied ? worst_slot() : none; slot != none;) {
+            for (const Node* node = ladder[slot].head; node; node = node->next) {
+                visit(node->order);
+            }
+            if (slot == best) {
+                break;
+            }
+            slot = next_better(BookSide == Side::Buy ? slot + 1 : slot - 1);
+        }
+    }
+
+    // Unlinks a resting order from its level in O(1) and returns its node to the pool.
+    void remove(Node* node) {
+        size_t slot = slot_of(node->order.price);
+        PriceLevel& level = ladder[slot];
+        level.quantity -= node->order.quantity;
+        level.order_count--;
+        if (node->prev) {
+            node->prev->next = node->next;
+        } else {
+            level.head = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
+        } else {
+            level.tail = node->prev;
+        }
+        if (!level.head) {
+            vacate(slot);
+        } else {
+            emit(DepthAction::Change, level);
+        }
+        pool->release(node);
+    }
+
+    // See PriceLevelBook::fill_best.
+    void fill_best(uint32_t quantity) {
+        PriceLevel& level = ladder[best];
+        level.head->order.quantity -= quantity;
+        level.quantity -= quantity;
+        if (level.head->order.quantity > 0) {
+            emit(DepthAction::Change, level);
+        }
+    }
+
+    // Lowers a resting order's quantity in place without losing time priority.
+    void reduce(Node* node, uint32_t quantity) {
+        PriceLevel& level = ladder[slot_of(node->order.price)];
+        level.quantity -= node->order.quantity - quantity;
+        node->order.quantity = quantity;
+        emit(DepthAction::Change, level);
+    }
+
+    Order* peek() {
+        return occupied == 0 ? nullptr : &ladder[best].head->order;
+    }
+
+    const PriceLevel& best_level() const {
+        return ladder[best];
+    }
+
+    bool is_empty() const {
+        return occupied == 0;
+    }
+
+    size_t level_count() const {
+        return occupied;
+    }
+};
+
+/*
+ * Execution is the compact record published for every fill.
+ * It names both sides of the trade, the traded quantity and the resting price.
+ */
+
+struct Execution {
+    uint64_t buy_order_id;
+    uint64_t sell_order_id;
+    Price price;
+    uint32_t quantity;
+    int32_t ticker;
+};
+
+/*
+ * MpscRing is a bounded lock-free multi-producer/single-consumer queue.
+ * - Each cell carries a sequence number telling producers and the consumer
+ *   whether it is free to write or ready to read (Vyukov's bounded queue).
+ * - Producers claim cells with a CAS on the enqueue position; the single consumer
+ *   advances the dequeue position without atomics.
+ * Capacity is rounded up to a power of two.
+ */
+
+template <typename T>
+class MpscRing {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) size_t dequeue_pos;
+
+public:
+    explicit MpscRing(size_t capacity) : enqueue_pos(0), dequeue_pos(0) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    // Returns false if the ring is full.
+    bool try_push(const T& value) {
+        size_t position;
+        return try_push(value, position);
+    }
+
+    // As above, also reporting the value's position in push order (values pop in that order).
+    bool try_push(const T& value, size_t& position) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    position = pos;
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Pops up to max_count values into out and returns how many were popped.
+    size_t pop_batch(T* out, size_t max_count) {
+        size_t count = 0;
+        while (count < max_count) {
+            Cell& cell = cells[dequeue_pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            if (sequence != dequeue_pos + 1) {
+                break;
+            }
+            out[count++] = cell.value;
+            cell.sequence.store(dequeue_pos + mask + 1, std::memory_order_release);
+            dequeue_pos++;
+        }
+        return count;
+    }
+
+    bool try_pop(T& out) {
+        return pop_batch(&out, 1) == 1;
+    }
+};
+
+/*
+ * ExecutionListener is the consumer interface for fills.
+ * Listeners receive executions in batches on the reporter thread.
+ */
+
+class ExecutionListener {
+public:
+    virtual ~ExecutionListener() = default;
+    virtual void on_executions(const Execution* executions, size_t count) = 0;
+};
+
+/*
+ * TextExecutionPrinter renders fills in the classic
+ * "Trade Executed: N shares of Ticker T at $P" format.
+ * Each batch is formatted into one buffer and written with a single flush.
+ */
+
+class TextExecutionPrinter : public ExecutionListener {
+private:
+    std::ostream& out;
+    std::string buffer;
+
+public:
+    explicit TextExecutionPrinter(std::ostream& stream = std::cout) : out(stream) {}
+
+    void on_executions(const Execution* executions, size_t count) override {
+        buffer.clear();
+        for (size_t i = 0; i < count; i++) {
+            const Execution& execution = executions[i];
+            buffer += "Trade Executed: ";
+            buffer += std::to_string(execution.quantity);
+            buffer += " shares of Ticker ";
+            buffer += std::to_string(execution.ticker);
+            buffer += " at $";
+            buffer += format_price(execution.price);
+            buffer += '\n';
+        }
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        out.flush();
+    }
+};
+
+/*
+ * ExecutionReporter moves trade reporting off the matching critical section.
+ * - Matching threads publish Execution records into an MpscRing.
+ * - A dedicated reporter thread drains the ring in batches and hands each batch
+ *   to every registered listener.
+ * If the ring is full, publishers yield until the reporter catches up, so fills are never dropped.
+ */
+
+class ExecutionReporter {
+private:
+    static constexpr size_t batch_size = 256;
+    MpscRing<Execution> ring;
+    std::vector<ExecutionListener*> listeners;
+    std::atomic<bool> running;
+    std::thread worker;
+
+    void run() {
+        std::vector<Execution> batch(batch_size);
+        int idle_rounds = 0;
+        for (;;) {
+            // Read the flag before draining: an empty drain after stop() means the ring is clear.
+            bool stopping = !running.load(std::memory_order_acquire);
+            size_t count = ring.pop_batch(batch.data(), batch_size);
+            if (count > 0) {
+                for (ExecutionListener* listener : listeners) {
+                    listener->on_executions(batch.data(), count);
+                }
+                idle_rounds = 0;
+            } else if (stopping) {
+                break;
+            } else if (++idle_rounds < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+
+public:
+    explicit ExecutionReporter(size_t capacity = 1 << 16) : ring(capacity), running(false) {}
+
+    ~ExecutionReporter() {
+        stop();
+    }
+
+    // Listeners must be registered before start().
+    void add_listener(ExecutionListener* listener) {
+        listeners.push_back(listener);
+    }
+
+    void start() {
+        running.store(true, std::memory_order_release);
+        worker = std::thread(&ExecutionReporter::run, this);
+    }
+
+    // Drains every published execution, then joins the reporter thread.
+    void stop() {
+        if (worker.joinable()) {
+            running.store(false, std::memory_order_release);
+            worker.join();
+        }
+    }
+
+    void publish(const Execution& execution) {
+        while (!ring.try_push(execution)) {
+            std::this_thread::yield();
+        }
+    }
+};
+
+/*
+ * DepthFeed carries incremental L2 updates from the matching threads to one
+ * market-data consumer.
+ * - Books emit a DepthUpdate for every level add, change or delete while holding the
+ *   ticker lock, so each ticker's updates are in sequence order.
+ * - The consumer polls batches at its own pace; publishing depth costs O(changes),
+ *   never a scan of the book.
+ * Emitters wait for space rather than drop updates, so an attached feed must be polled.
+ */
+
+class DepthFeed {
+private:
+    MpscRing<DepthUpdate> ring;
+
+public:
+    explicit DepthFeed(size_t capacity = 1 << 16) : ring(capacity) {}
+
+    void publish(const DepthUpdate& update) {
+        while (!ring.try_push(update)) {
+            std::this_thread::yield();
+        }
+    }
+
+    // Pops up to max_count updates; call from a single consumer thread.
+    size_t poll(DepthUpdate* out, size_t max_count) {
+        return ring.pop_batch(out, max_count);
+    }
+};
+
+inline void DepthEmitter::emit(DepthAction action, Side side, const PriceLevel& level) {
+    feed->publish(DepthUpdate{++sequence, level.price, level.quantity, level.order_count, ticker, side, action});
+}
+
+/*
+ * OrderLogRecord is one entry of the binary order log: every add, cancel and
+ * modify that changed a book, with the order ID the engine assigned.
+ * Records are fixed-size and written in native byte order.
+ */
+
+enum class OrderLogType : uint8_t {
+    Add,
+    Cancel,
+    Modify,
+    // The ticker entered an auction call phase / was uncrossed; only ticker is set.
+    AuctionOpen,
+    AuctionUncross
+};
+
+struct OrderLogRecord {
+    uint64_t order_id;
+    Price price;
+    uint32_t quantity;
+    int32_t ticker;
+    OrderLogType type;
+    Side side;
+    // Zero (Limit) in logs written before order types existed.
+    OrderType order_type;
+    uint8_t reserved[5];
+};
+
+static_assert(sizeof(OrderLogRecord) == 32, "OrderLogRecord layout is part of the file format");
+static_assert(std::is_trivially_copyable<OrderLogRecord>::value, "OrderLogRecord must stay trivially copyable");
+
+/*
+ * Order log files start with this header, followed by packed OrderLogRecords.
+ */
+
+struct OrderLogHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+constexpr char order_log_magic[8] = {'S', 'T', 'E', 'O', 'R', 'D', 'L', 'G'};
+constexpr uint32_t order_log_version = 1;
+
+inline OrderLogRecord make_log_record(OrderLogType type, const Order& order) {
+    OrderLogRecord record{};
+    record.order_id = order.order_id;
+    record.price = order.price;
+    record.quantity = order.quantity;
+    record.ticker = order.ticker;
+    record.type = type;
+    record.side = order.side;
+    record.order_type = order.type;
+    return record;
+}
+
+/*
+ * OrderLogSink is the consumer interface for the accepted order stream.
+ * OrderBook calls it while holding the ticker lock, so implementations must only
+ * enqueue and never block on I/O. Each fill is passed to append_fill under the same
+ * lock, right after the order that caused it; sinks that only capture orders ignore it.
+ */
+
+class OrderLogSink {
+public:
+    virtual ~OrderLogSink() = default;
+    virtual void append(OrderLogType type, const Order& order) = 0;
+    virtual void append_fill(const Execution&) {}
+};
+
+/*
+ * OrderLogWriter captures the order stream to a binary log for deterministic replay.
+ * - OrderBook appends a record while holding the ticker lock, so the log order is
+ *   a valid serialization of what every ticker actually applied.
+ * - Records go through an MpscRing to a writer thread that batches them into large
+ *   fwrite calls, keeping file I/O off the matching path.
+ * - A short write or failed flush (e.g. a full disk) is recorded in error() as Journal
+ *   does. Nothing more is written, so the log stays a replayable prefix, and append
+ *   throws, so OrderBook refuses orders it can no longer capture.
+ */
+
+class OrderLogWriter : public OrderLogSink {
+private:
+    static constexpr size_t batch_size = 4096;
+    MpscRing<OrderLogRecord> ring;
+    FILE* file;
+    std::atomic<bool> running;
+    // errno of the first failed write or flush; 0 while the capture is complete.
+    std::atomic<int> failure;
+    std::thread worker;
+
+    void fail(int error) {
+        int healthy = 0;
+        failure.compare_exchange_strong(healthy, error != 0 ? error : EIO, std::memory_order_release);
+    }
+
+    void run() {
+        std::vector<OrderLogRecord> batch(batch_size);
+        int idle_rounds = 0;
+        for (;;) {
+            // Read the flag before draining: an empty drain after close() means the ring is clear.
+            bool stopping = !running.load(std::memory_order_acquire);
+            size_t count = ring.pop_batch(batch.data(), batch_size);
+            if (count > 0) {
+                // After a failure keep draining, so producers never block, but write nothing.
+                errno = 0;
+                if (!failed() && std::fwrite(batch.data(), sizeof(OrderLogRecord), count, file) != count) {
+                    fail(errno);
+                }
+                idle_rounds = 0;
+            } else if (stopping) {
+                break;
+            } else if (++idle_rounds < 64) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    }
+
+public:
+    explicit OrderLogWriter(const std::string& path, size_t capacity = 1 << 16)
+        : ring(capacity), file(std::fopen(path.c_str(), "wb")), running(true), failure(0) {
+        if (!file) {
+            throw std::runtime_error("cannot open order log for writing: " + path);
+        }
+        OrderLogHeader header{};
+        std::memcpy(header.magic, order_log_magic, sizeof(header.magic));
+        header.version = order_log_version;
+        header.record_size = sizeof(OrderLogRecord);
+        if (std::fwrite(&header, sizeof(header), 1, file) != 1) {
+            std::fclose(file);
+            throw std::runtime_error("cannot write order log header: " + path);
+        }
+        worker = std::thread(&OrderLogWriter::run, this);
+    }
+
+    ~OrderLogWriter() {
+        close();
+    }
+
+    // Writes every appended record and closes the file; check failed() afterwards.
+    void close() {
+        if (worker.joinable()) {
+            running.store(false, std::memory_order_release);
+            worker.join();
+        }
+        if (file) {
+            errno = 0;
+            if (std::fflush(file) != 0) {
+                fail(errno);
+            }
+            errno = 0;
+            if (std::fclose(file) != 0) {
+                fail(errno);
+            }
+            file = nullptr;
+        }
+    }
+
+    // errno of the failure that truncated the log, or 0.
+    int error() const {
+        return failure.load(std::memory_order_acquire);
+    }
+
+    bool failed() const {
+        return error() != 0;
+    }
+
+    // Throws std::runtime_error once a write has failed.
+    void append(const OrderLogRecord& record) {
+        if (failed()) {
+            throw std::runtime_error(std::string("order log write failed: ") + std::strerror(error()));
+        }
+        while (!ring.try_push(record)) {
+            std::this_thread::yield();
+        }
+    }
+
+    void append(OrderLogType type, const Order& order) override {
+        append(make_log_record(type, order));
+    }
+};
+
+/*
+ * OrderLogReader streams records back from an order log in large chunks.
+ * It is the portable fallback for platforms without MappedOrderLog.
+ */
+
+class OrderLogReader {
+private:
+    static constexpr size_t chunk_records = 1 << 15;
+    FILE* file;
+    std::vector<OrderLogRecord> chunk;
+
+public:
+    explicit OrderLogReader(const std::string& path) : file(std::fopen(path.c_str(), "rb")), chunk(chunk_records) {
+        if (!file) {
+            throw std::runtime_error("cannot open order log for reading: " + path);
+        }
+        OrderLogHeader header{};
+        if (std::fread(&header, sizeof(header), 1, file) != 1
+            || std::memcmp(header.magic, order_log_magic, sizeof(header.magic)) != 0
+            || header.version != order_log_version || header.record_size != sizeof(OrderLogRecord)) {
+            std::fclose(file);
+            throw std::runtime_error("not a version 1 order log: " + path);
+        }
+    }
+
+    ~OrderLogReader() {
+        std::fclose(file);
+    }
+
+    OrderLogReader(const OrderLogReader&) = delete;
+    OrderLogReader& operator=(const OrderLogReader&) = delete;
+
+    // Reads the next chunk; returns the number of records available in records().
+    size_t next() {
+        return std::fread(chunk.data(), sizeof(OrderLogRecord), chunk_records, file);
+    }
+
+    const OrderLogRecord* records() const {
+        return chunk.data();
+    }
+};
+
+#ifdef STOCK_ENGINE_HAS_MMAP
+/*
+ * MappedOrderLog maps an order log read-only and exposes its records in place.
+ * - Records are fixed-size and naturally aligned after the header, so the engine
+ *   reads them straight from the mapped pages with no parsing or copying.
+ * - The kernel is told the access is sequential, and release_before() drops pages
+ *   that were already consumed so multi-GB captures do not crowd the page cache.
+ */
+
+class MappedOrderLog {
+private:
+    int fd;
+    void* base;
+    size_t length;
+    const OrderLogRecord* first;
+    size_t count;
+    size_t released;
+
+public:
+    explicit MappedOrderLog(const std::string& path)
+        : fd(::open(path.c_str(), O_RDONLY)), base(MAP_FAILED), length(0), first(nullptr), count(0), released(0) {
+        if (fd < 0) {
+            throw std::runtime_error("cannot open order log for reading: " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(OrderLogHeader)) {
+            ::close(fd);
+            throw std::runtime_error("not a version 1 order log: " + path);
+        }
+        length = static_cast<size_t>(info.st_size);
+        base = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("cannot map order log: " + path);
+        }
+        const OrderLogHeader* header = static_cast<const OrderLogHeader*>(base);
+        if (std::memcmp(header->magic, order_log_magic, sizeof(header->magic)) != 0
+            || header->version != order_log_version || header->record_size != sizeof(OrderLogRecord)) {
+            ::munmap(base, length);
+            ::close(fd);
+            throw std::runtime_error("not a version 1 order log: " + path);
+        }
+        ::madvise(base, length, MADV_SEQUENTIAL);
+        first = reinterpret_cast<const OrderLogRecord*>(static_cast<const char*>(base) + sizeof(OrderLogHeader));
+        count = (length - sizeof(OrderLogHeader)) / sizeof(OrderLogRecord);
+    }
+
+    ~MappedOrderLog() {
+        ::munmap(base, length);
+        ::close(fd);
+    }
+
+    MappedOrderLog(const MappedOrderLog&) = delete;
+    MappedOrderLog& operator=(const MappedOrderLog&) = delete;
+
+    const OrderLogRecord* records() const {
+        return first;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Lets the kernel drop the pages holding records [0, record_index).
+    void release_before(size_t record_index) {
+        static const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t end = sizeof(OrderLogHeader) + record_index * sizeof(OrderLogRecord);
+        end -= end % page;
+        if (end > released) {
+            ::madvise(static_cast<char*>(base) + released, end - released, MADV_DONTNEED);
+            released = end;
+        }
+    }
+};
+#endif
+
+/*
+ * FillDigest folds the fill stream into an FNV-1a hash and can also write the
+ * raw Execution records to a file. Two runs with equal digests produced
+ * bit-identical fills in the same order.
+ * A short write or failed close of that file is recorded in error() as
+ * OrderLogWriter does; nothing more is written after it.
+ */
+
+class FillDigest : public ExecutionListener {
+private:
+    FILE* file;
+    // errno of the first failed write or close; only touched by the reporter thread until close().
+    int failure;
+
+    void fail(int error) {
+        if (failure == 0) {
+            failure = error != 0 ? error : EIO;
+        }
+    }
+
+public:
+    uint64_t digest = 0xcbf29ce484222325ull;
+    uint64_t fills = 0;
+
+    explicit FillDigest(const std::string& path = "") : file(nullptr), failure(0) {
+        if (!path.empty()) {
+            file = std::fopen(path.c_str(), "wb");
+            if (!file) {
+                throw std::runtime_error("cannot open fill output: " + path);
+            }
+        }
+    }
+
+    ~FillDigest() {
+        close();
+    }
+
+    FillDigest(const FillDigest&) = delete;
+    FillDigest& operator=(const FillDigest&) = delete;
+
+    // Flushes and closes the fill output once the reporter has stopped; check failed() afterwards.
+    void close() {
+        if (file) {
+            errno = 0;
+            if (std::fflush(file) != 0) {
+                fail(errno);
+            }
+            errno = 0;
+            if (std::fclose(file) != 0) {
+                fail(errno);
+            }
+            file = nullptr;
+        }
+    }
+
+    // errno of the failure that truncated the fill output, or 0.
+    int error() const {
+        return failure;
+    }
+
+    bool failed() const {
+        return failure != 0;
+    }
+
+    void on_executions(const Execution* executions, size_t count) override {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(executions);
+        for (size_t i = 0; i < count * sizeof(Execution); i++) {
+            digest = (digest ^ bytes[i]) * 0x100000001b3ull;
+        }
+        fills += count;
+        if (file && !failed()) {
+            errno = 0;
+            if (std::fwrite(executions, sizeof(Execution), count, file) != count) {
+                fail(errno);
+            }
+        }
+    }
+};
+
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+/*
+ * JournalEntry is one 48-byte write-ahead journal record: an accepted order or a fill.
+ * Sequence numbers are assigned by the journal writer and start at 1; a zero type
+ * marks the unwritten (preallocated) tail of a segment.
+ */
+
+enum class JournalEntryType : uint8_t {
+    Invalid,
+    Order,
+    Fill
+};
+
+struct JournalEntry {
+    uint64_t sequence;
+    JournalEntryType type;
+    uint8_t reserved[7];
+    union {
+        OrderLogRecord order;
+        Execution fill;
+    };
+};
+
+static_assert(sizeof(JournalEntry) == 48, "JournalEntry layout is part of the journal format");
+
+/*
+ * Journal is a write-ahead log of accepted orders and fills with group commit.
+ * - Producers (OrderBook through OrderLogSink, under the ticker lock) only enqueue
+ *   into an MpscRing, so every fill is journalled after the order that caused it.
+ * - A dedicated writer thread packs entries into a block-aligned buffer and commits
+ *   them with one pwrite + fdatasync once group_commit_bytes have built up or the
+ *   oldest pending entry is group_commit_micros old.
+ * - Segments are preallocated to segment_bytes with posix_fallocate and opened with
+ *   O_DIRECT where the filesystem supports it; a partially written last block is kept
+ *   in the buffer and rewritten in place by the next commit.
+ * - Segments are created with O_EXCL, so a directory already holding a journal is
+ *   refused rather than overwritten; give every run its own directory.
+ * durable_sequence() reports the highest sequence number known to be on disk.
+ * - Sequence numbers follow ring order, so append_order() returns an order's sequence
+ *   as it is enqueued. last_appended() gives a thread the sequence of the last entry it
+ *   appended, which after an OrderBook call is its order's last fill (or the order),
+ *   and wait_durable(last_appended()) blocks until the order and its fills are on disk.
+ * - A failed write, sync or segment open (ENOSPC, EIO) is recorded in error() rather
+ *   than thrown on the writer thread. The durable sequence stops advancing, order
+ *   appends throw, so OrderBook refuses orders it can no longer journal, and
+ *   wait_durable throws for anything not already durable. Fills are dropped.
+ */
+
+class Journal : public OrderLogSink {
+public:
+    struct Config {
+        std::string directory = ".";
+        size_t segment_bytes = size_t(64) << 20;
+        size_t group_commit_bytes = size_t(64) << 10;
+        long group_commit_micros = 200;
+        bool direct_io = true;
+        size_t queue_capacity = 1 << 16;
+    };
+
+private:
+    static constexpr size_t block_size = 4096;
+    static constexpr size_t batch_size = 1024;
+
+    Config config;
+    MpscRing<JournalEntry> ring;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> durable;
+    // errno of the first failed write, sync or segment open; 0 while healthy.
+    std::atomic<int> failure;
+    // Set by the writer once it has committed everything and exited.
+    std::atomic<bool> stopped;
+    std::thread worker;
+
+    int fd;
+    uint32_t segment_number;
+    unsigned char* buffer;
+    size_t buffer_capacity;
+    size_t buffer_used;
+    // Offset within the current segment that buffer[0] will be written to; always block-aligned.
+    uint64_t buffer_offset;
+    uint64_t next_sequence;
+    uint64_t pending_sequence;
+    size_t uncommitted_bytes;
+
+    static size_t round_up(size_t value, size_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    std::string segment_path(uint32_t number) const {
+        char name[32];
+        std::snprintf(name, sizeof(name), "journal-%06u.log", number);
+        return config.directory + "/" + name;
+    }
+
+    void open_segment(uint32_t number) {
+        std::string path = segment_path(number);
+        // Never O_TRUNC: an existing segment belongs to an earlier run's journal.
+        int flags = O_WRONLY | O_CREAT | O_EXCL;
+#ifdef O_DIRECT
+        if (config.direct_io) {
+            fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+            // tmpfs and some other filesystems reject O_DIRECT; fall back to buffered I/O.
+            if (fd < 0 && errno == EINVAL) {
+                fd = ::open(path.c_str(), flags, 0644);
+            }
+        } else {
+            fd = ::open(path.c_str(), flags, 0644);
+        }
+#else
+        fd = ::open(path.c_str(), flags, 0644);
+#endif
+        if (fd < 0) {
+            throw std::runtime_error("cannot open journal segment: " + path + ": " + std::strerror(errno));
+        }
+        if (int error = ::posix_fallocate(fd, 0, static_cast<off_t>(config.segment_bytes))) {
+            ::close(fd);
+            fd = -1;
+            errno = error;
+            throw std::runtime_error("cannot preallocate journal segment: " + path);
+        }
+        segment_number = number;
+        buffer_offset = 0;
+    }
+
+    bool sync() {
+#ifdef __APPLE__
+        return ::fsync(fd) == 0;
+#else
+        return ::fdatasync(fd) == 0;
+#endif
+    }
+
+    // pwrite of the whole length, continuing after short writes so a failure leaves its errno.
+    bool write_fully(size_t length, uint64_t offset) {
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = ::pwrite(fd, buffer + written, length - written, static_cast<off_t>(offset + written));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    void fail(int error) {
+        int healthy = 0;
+        failure.compare_exchange_strong(healthy, error != 0 ? error : EIO, std::memory_order_release);
+    }
+
+    // Writes the buffer (padded with zeros to a whole block) and makes it durable.
+    void commit() {
+        if (failed() || buffer_used == 0 || pending_sequence == durable.load(std::memory_order_relaxed)) {
+            return;
+        }
+        size_t length = round_up(buffer_used, block_size);
+        errno = 0;
+        if (!write_fully(length, buffer_offset) || !sync()) {
+            fail(errno);
+            return;
+        }
+        durable.store(pending_sequence, std::memory_order_release);
+        uncommitted_bytes = 0;
+
+        // Keep the partially filled last block so the next commit rewrites it in place.
+        size_t full = buffer_used / block_size * block_size;
+        if (full > 0) {
+            size_t tail = buffer_used - full;
+            std::memmove(buffer, buffer + full, tail);
+            std::memset(buffer + tail, 0, buffer_used - tail);
+            buffer_offset += full;
+            buffer_used = tail;
+        }
+    }
+
+    void append_entry(JournalEntry& entry) {
+        if (failed()) {
+            return;
+        }
+        if (buffer_offset + buffer_used + sizeof(JournalEntry) > config.segment_bytes) {
+            commit();
+            // A failed commit leaves the segment's tail unwritten; never roll past it.
+            if (failed()) {
+                return;
+            }
+            ::close(fd);
+            fd = -1;
+            std::memset(buffer, 0, buffer_capacity);
+            buffer_used = 0;
+            try {
+                open_segment(segment_number + 1);
+            } catch (const std::exception&) {
+                fail(errno);
+                return;
+            }
+        }
+        if (buffer_used + sizeof(JournalEntry) > buffer_capacity) {
+            commit();
+            // The buffer is still full after a failed commit.
+            if (failed()) {
+                return;
+            }
+        }
+        entry.sequence = next_sequence++;
+        std::memcpy(buffer + buffer_used, &entry, sizeof(JournalEntry));
+        buffer_used += sizeof(JournalEntry);
+        uncommitted_bytes += sizeof(JournalEntry);
+        pending_sequence = entry.sequence;
+    }
+
+    void run() {
+        std::vector<JournalEntry> batch(batch_size);
+        auto oldest_pending = std::chrono::steady_clock::now();
+        bool has_pending = false;
+        const auto max_delay = std::chrono::microseconds(config.group_commit_micros);
+        for (;;) {
+            // Read the flag before draining: an empty drain after close() means the ring is clear.
+            bool stopping = !running.load(std::memory_order_acquire);
+            size_t count = ring.pop_batch(batch.data(), batch_size);
+            if (count > 0 && !has_pending) {
+                oldest_pending = std::chrono::steady_clock::now();
+                has_pending = true;
+            }
+            for (size_t i = 0; i < count; i++) {
+                append_entry(batch[i]);
+            }
+            if (has_pending) {
+                bool size_due = uncommitted_bytes >= config.group_commit_bytes;
+                bool time_due = std::chrono::steady_clock::now() - oldest_pending >= max_delay;
+                if (size_due || time_due || (count == 0 && stopping)) {
+                    commit();
+                    has_pending = false;
+                }
+            }
+            if (count == 0) {
+                if (stopping) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+        }
+        stopped.store(true, std::memory_order_release);
+    }
+
+    // Returns the sequence number the entry will be written with.
+    uint64_t enqueue(const JournalEntry& entry) {
+        size_t position;
+        while (!ring.try_push(entry, position)) {
+            std::this_thread::yield();
+        }
+        return position + 1;
+    }
+
+    struct LastAppended {
+        const Journal* journal;
+        uint64_t sequence;
+    };
+
+    static LastAppended& last_appended_slot() {
+        thread_local LastAppended last{nullptr, 0};
+        return last;
+    }
+
+    [[noreturn]] void throw_failure() const {
+        throw std::runtime_error(std::string("journal write failed: ") + std::strerror(error()));
+    }
+
+public:
+    explicit Journal(const Config& journal_config)
+        : config(journal_config), ring(journal_config.queue_capacity), running(true), durable(0), failure(0), stopped(false),
+          fd(-1), segment_number(0), buffer(nullptr), buffer_used(0), buffer_offset(0),
+          next_sequence(1), pending_sequence(0), uncommitted_bytes(0) {
+        if (config.segment_bytes % block_size != 0 || config.segment_bytes < block_size) {
+            throw std::invalid_argument("journal segment size must be a positive multiple of 4096");
+        }
+        buffer_capacity = round_up(std::max(config.group_commit_bytes, block_size), block_size) + block_size;
+        void* memory = nullptr;
+        if (::posix_memalign(&memory, block_size, buffer_capacity) != 0) {
+            throw std::bad_alloc();
+        }
+        buffer = static_cast<unsigned char*>(memory);
+        std::memset(buffer, 0, buffer_capacity);
+        try {
+            open_segment(0);
+        } catch (...) {
+            // The destructor does not run for a constructor that throws.
+            std::free(buffer);
+            throw;
+        }
+        worker = std::thread(&Journal::run, this);
+    }
+
+    ~Journal() {
+        close();
+        std::free(buffer);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Commits every enqueued entry, then stops the writer and closes the segment.
+    void close() {
+        if (worker.joinable()) {
+            running.store(false, std::memory_order_release);
+            worker.join();
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    uint64_t durable_sequence() const {
+        return durable.load(std::memory_order_acquire);
+    }
+
+    // errno of the failure that stopped the journal, or 0.
+    int error() const {
+        return failure.load(std::memory_order_acquire);
+    }
+
+    bool failed() const {
+        return error() != 0;
+    }
+
+    // Enqueues an order record and returns its sequence; throws once the journal has failed.
+    uint64_t append_order(OrderLogType type, const Order& order) {
+        if (failed()) {
+            throw_failure();
+        }
+        JournalEntry entry{};
+        entry.type = JournalEntryType::Order;
+        entry.order = make_log_record(type, order);
+        uint64_t sequence = enqueue(entry);
+        last_appended_slot() = LastAppended{this, sequence};
+        return sequence;
+    }
+
+    // Sequence of the last order or fill this thread appended to this journal, or 0.
+    uint64_t last_appended() const {
+        const LastAppended& last = last_appended_slot();
+        return last.journal == this ? last.sequence : 0;
+    }
+
+    /*
+     * Blocks until every entry up to sequence is durable. Throws std::runtime_error
+     * if the journal failed before getting there, or closed without writing it.
+     */
+    void wait_durable(uint64_t sequence) const {
+        while (durable.load(std::memory_order_acquire) < sequence) {
+            if (failed()) {
+                throw_failure();
+            }
+            if (stopped.load(std::memory_order_acquire) && durable.load(std::memory_order_acquire) < sequence) {
+                throw std::runtime_error("journal closed before the entry was durable");
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(10));
+        }
+    }
+
+    void append(OrderLogType type, const Order& order) override {
+        append_order(type, order);
+    }
+
+    // Fills of an already journalled order are dropped rather than thrown mid-match once the journal has failed.
+    void append_fill(const Execution& execution) override {
+        if (failed()) {
+            return;
+        }
+        JournalEntry entry{};
+        entry.type = JournalEntryType::Fill;
+        entry.fill = execution;
+        last_appended_slot() = LastAppended{this, enqueue(entry)};
+    }
+};
+#endif
+
+/*
+ * Hint to the CPU that we are spinning, so it can yield the pipeline to the
+ * sibling hyperthread and avoid a memory-order flush when the lock frees up.
+ */
+
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/*
+ * Lock policies for the per-ticker locks. Each one is Lockable
+ * (lock()/try_lock()/unlock()) so OrderBook can be instantiated with whichever suits
+ * the host, and lock_counting_spins() reports how long a contended acquire spun.
+ * - TTASSpinLock: test-and-test-and-set with pause and exponential backoff,
+ *   falling back to yielding once the backoff is exhausted.
+ * - TicketLock: FIFO-fair spinlock; waiters back off in proportion to their
+ *   distance from the head of the queue. Handoff stalls if the next waiter is
+ *   descheduled, so it suits hosts with a core per matching thread.
+ * - MutexLock: std::mutex, which parks waiters in the kernel on oversubscribed hosts.
+ * - NullLock: no locking at all, for single-owner books.
+ */
+
+class TTASSpinLock {
+private:
+    static constexpr unsigned max_backoff = 1024;
+    std::atomic<bool> locked{false};
+
+public:
+    // Acquires the lock; returns the pause and yield iterations spent waiting.
+    uint32_t lock_counting_spins() {
+        unsigned backoff = 1;
+        uint32_t spins = 0;
+        for (;;) {
+            if (!locked.exchange(true, std::memory_order_acquire)) {
+                return spins;
+            }
+            while (locked.load(std::memory_order_relaxed)) {
+                if (backoff <= max_backoff) {
+                    for (unsigned i = 0; i < backoff; i++) {
+                        cpu_relax();
+                    }
+                    spins += backoff;
+                    backoff <<= 1;
+                } else {
+                    std::this_thread::yield();
+                    spins++;
+                }
+            }
+        }
+    }
+
+    void lock() {
+        lock_counting_spins();
+    }
+
+    bool try_lock() {
+        return !locked.load(std::memory_order_relaxed) && !locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() {
+        locked.store(false, std::memory_order_release);
+    }
+};
+
+class TicketLock {
+private:
+    static constexpr uint32_t spins_per_waiter = 64;
+    static constexpr uint32_t yield_threshold = 1 << 10;
+    std::atomic<uint32_t> next_ticket{0};
+    std::atomic<uint32_t> now_serving{0};
+
+public:
+    // Acquires the lock; returns the pause and yield iterations spent waiting.
+    uint32_t lock_counting_spins() {
+        uint32_t ticket = next_ticket.fetch_add(1, std::memory_order_relaxed);
+        uint32_t spins = 0;
+        uint32_t yields = 0;
+        for (;;) {
+            uint32_t serving = now_serving.load(std::memory_order_acquire);
+            if (serving == ticket) {
+                return spins + yields;
+            }
+            if (spins >= yield_threshold) {
+                std::this_thread::yield();
+                yields++;
+                continue;
+            }
+            uint32_t wait = (ticket - serving) * spins_per_waiter;
+            for (uint32_t i = 0; i < wait; i++) {
+                cpu_relax();
+            }
+            spins += wait;
+        }
+    }
+
+    void lock() {
+        lock_counting_spins();
+    }
+
+    // Takes the lock only if nobody holds or is queued for it.
+    bool try_lock() {
+        uint32_t serving = now_serving.load(std::memory_order_acquire);
+        return next_ticket.compare_exchange_strong(serving, serving + 1, std::memory_order_acquire,
+                                                   std::memory_order_relaxed);
+    }
+
+    void unlock() {
+        now_serving.store(now_serving.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+/*
+ * NullLock is for books owned by a single thread (see ShardedEngine);
+ * it compiles the per-ticker locking away entirely.
+ */
+
+class NullLock {
+public:
+    uint32_t lock_counting_spins() {
+        return 0;
+    }
+    void lock() {}
+    bool try_lock() {
+        return true;
+    }
+    void unlock() {}
+};
+
+class MutexLock {
+private:
+    std::mutex mutex;
+
+public:
+    // Waiters sleep in the kernel rather than spin, so only the wait time is meaningful.
+    uint32_t lock_counting_spins() {
+        mutex.lock();
+        return 0;
+    }
+
+    void lock() {
+        mutex.lock();
+    }
+
+    bool try_lock() {
+        return mutex.try_lock();
+    }
+
+    void unlock() {
+        mutex.unlock();
+    }
+};
+
+// Lock policy used by the default OrderBook; override with -DSTOCK_ENGINE_LOCK_POLICY=TicketLock etc.
+#ifndef STOCK_ENGINE_LOCK_POLICY
+#define STOCK_ENGINE_LOCK_POLICY TTASSpinLock
+#endif
+using DefaultLockPolicy = STOCK_ENGINE_LOCK_POLICY;
+
+// Hot-path instrumentation; build with -DSTOCK_ENGINE_METRICS=0 to compile it out.
+#ifndef STOCK_ENGINE_METRICS
+#define STOCK_ENGINE_METRICS 1
+#endif
+constexpr bool metrics_enabled = STOCK_ENGINE_METRICS != 0;
+
+/*
+ * Cycle counter for hot-path timing: rdtsc on x86, the steady clock in
+ * nanoseconds elsewhere.
+ */
+
+inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// read_cycles() ticks per nanosecond, calibrated once against the steady clock.
+inline double cycles_per_ns() {
+    static const double rate = []() {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t start_cycles = read_cycles();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        uint64_t end_cycles = read_cycles();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        return ns > 0 && end_cycles > start_cycles ? (end_cycles - start_cycles) / ns : 1.0;
+    }();
+    return rate;
+}
+
+// Adds to a counter with a single writer; a plain load and store, never a locked RMW.
+inline void metric_add(std::atomic<uint64_t>& counter, uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/*
+ * Log2Histogram counts values in power-of-two buckets: bucket 0 holds 0 and
+ * bucket b holds [2^(b-1), 2^b). It has a single writer (the thread or the ticker
+ * lock holder that owns it); exporters read it at any time without locking.
+ */
+
+class Log2Histogram {
+public:
+    static constexpr size_t bucket_count = 40;
+
+private:
+    std::atomic<uint64_t> buckets[bucket_count]{};
+
+public:
+    void record(uint64_t value) {
+        size_t bits = value == 0 ? 0 : 64 - static_cast<size_t>(__builtin_clzll(value));
+        metric_add(buckets[std::min(bits, bucket_count - 1)]);
+    }
+
+    uint64_t bucket(size_t index) const {
+        return buckets[index].load(std::memory_order_relaxed);
+    }
+};
+
+// Point-in-time sum of one or more Log2Histograms.
+struct Log2Summary {
+    uint64_t buckets[Log2Histogram::bucket_count] = {};
+
+    void add(const Log2Histogram& histogram) {
+        for (size_t i = 0; i < Log2Histogram::bucket_count; i++) {
+            buckets[i] += histogram.bucket(i);
+        }
+    }
+
+    void add(const Log2Summary& other) {
+        for (size_t i = 0; i < Log2Histogram::bucket_count; i++) {
+            buckets[i] += other.buckets[i];
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (uint64_t bucket : buckets) {
+            total += bucket;
+        }
+        return total;
+    }
+
+    // Upper bound of the bucket holding the given percentile.
+    uint64_t percentile(double percent) const {
+        uint64_t total = count();
+        uint64_t target = static_cast<uint64_t>(std::ceil(total * percent / 100.0));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < Log2Histogram::bucket_count; i++) {
+            seen += buckets[i];
+            if (seen >= target && seen > 0) {
+                return i == 0 ? 0 : (uint64_t(1) << i) - 1;
+            }
+        }
+        return 0;
+    }
+};
+
+/*
+ * TickerMetrics are one ticker's hot-path counters. They are only written while
+ * holding the ticker lock, so they are sharded by construction and never need
+ * atomic read-modify-writes; exporters read them with relaxed loads.
+ */
+
+struct TickerMetrics {
+    std::atomic<uint64_t> orders_added{0};
+    std::atomic<uint64_t> fills{0};
+    // Fills that left the incoming or the resting order with quantity remaining.
+    std::atomic<uint64_t> partial_fills{0};
+    // IOC and market orders with an unfilled remainder, and rejected fill-or-kill orders.
+    std::atomic<uint64_t> orders_killed{0};
+    std::atomic<uint64_t> match_iterations{0};
+    std::atomic<uint64_t> lock_acquisitions{0};
+    std::atomic<uint64_t> lock_contended{0};
+    std::atomic<uint64_t> lock_wait_cycles{0};
+    std::atomic<uint64_t> bid_levels{0};
+    std::atomic<uint64_t> ask_levels{0};
+    Log2Histogram lock_spins;
+    Log2Histogram lock_wait;
+};
+
+/*
+ * ThreadMetrics holds the per-thread timing histograms of the insert and match
+ * scopes. Every thread registers its own cache-line-aligned block on first use,
+ * so recording never shares a line with another thread.
+ * Reading the cycle counter is not free (tens of ns under some hypervisors), so
+ * only one order in timing_sample_period is timed.
+ */
+
+struct alignas(64) ThreadMetrics {
+    static constexpr uint32_t timing_sample_period = 64;
+    Log2Histogram insert_cycles;
+    Log2Histogram match_cycles;
+    uint32_t timing_countdown = 0;
+
+    // True for the orders whose scopes should be timed.
+    bool sample_timing() {
+        if (!metrics_enabled || timing_countdown-- != 0) {
+            return false;
+        }
+        timing_countdown = timing_sample_period - 1;
+        return true;
+    }
+};
+
+class MetricsRegistry {
+private:
+    std::mutex mutex;
+    // Blocks outlive their threads so counts of finished threads are still exported.
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+
+public:
+    static MetricsRegistry& instance() {
+        static MetricsRegistry registry;
+        return registry;
+    }
+
+    // The calling thread's block.
+    static ThreadMetrics& local() {
+        thread_local ThreadMetrics* mine = instance().add_thread();
+        return *mine;
+    }
+
+    ThreadMetrics* add_thread() {
+        std::lock_guard<std::mutex> guard(mutex);
+        threads.emplace_back(new ThreadMetrics());
+        return threads.back().get();
+    }
+
+    void collect(Log2Summary& insert_cycles, Log2Summary& match_cycles) {
+        std::lock_guard<std::mutex> guard(mutex);
+        for (const auto& thread : threads) {
+            insert_cycles.add(thread->insert_cycles);
+            match_cycles.add(thread->match_cycles);
+        }
+    }
+};
+
+// Records the cycles spent in a scope into a histogram; a null histogram times nothing.
+class CycleScope {
+private:
+    Log2Histogram* histogram;
+    uint64_t start;
+
+public:
+    explicit CycleScope(Log2Histogram* target) : histogram(target), start(target ? read_cycles() : 0) {}
+
+    ~CycleScope() {
+        if (histogram) {
+            histogram->record(read_cycles() - start);
+        }
+    }
+
+    CycleScope(const CycleScope&) = delete;
+    CycleScope& operator=(const CycleScope&) = delete;
+};
+
+// Plain copy of one ticker's metrics, taken for export.
+struct TickerMetricsSnapshot {
+    int32_t ticker;
+    uint64_t orders_added;
+    uint64_t fills;
+    uint64_t partial_fills;
+    uint64_t orders_killed;
+    uint64_t match_iterations;
+    uint64_t lock_acquisitions;
+    uint64_t lock_contended;
+    uint64_t lock_wait_cycles;
+    uint64_t bid_levels;
+    uint64_t ask_levels;
+    Log2Summary lock_spins;
+    Log2Summary lock_wait;
+
+    static TickerMetricsSnapshot of(int32_t ticker, const TickerMetrics& metrics) {
+        TickerMetricsSnapshot snapshot;
+        snapshot.ticker = ticker;
+        snapshot.orders_added = metrics.orders_added.load(std::memory_order_relaxed);
+        snapshot.fills = metrics.fills.load(std::memory_order_relaxed);
+        snapshot.partial_fills = metrics.partial_fills.load(std::memory_order_relaxed);
+        snapshot.orders_killed = metrics.orders_killed.load(std::memory_order_relaxed);
+        snapshot.match_iterations = metrics.match_iterations.load(std::memory_order_relaxed);
+        snapshot.lock_acquisitions = metrics.lock_acquisitions.load(std::memory_order_relaxed);
+        snapshot.lock_contended = metrics.lock_contended.load(std::memory_order_relaxed);
+        snapshot.lock_wait_cycles = metrics.lock_wait_cycles.load(std::memory_order_relaxed);
+        snapshot.bid_levels = metrics.bid_levels.load(std::memory_order_relaxed);
+        snapshot.ask_levels = metrics.ask_levels.load(std::memory_order_relaxed);
+        snapshot.lock_spins.add(metrics.lock_spins);
+        snapshot.lock_wait.add(metrics.lock_wait);
+        return snapshot;
+    }
+};
+
+/*
+ * Print a metrics report: engine totals, the per-thread insert/match timing
+ * scopes, and the top_tickers tickers with the most lock wait time.
+ * Cycle figures are converted to approximate nanoseconds with cycles_per_ns().
+ */
+
+inline void print_metrics_report(std::ostream& out, std::vector<TickerMetricsSnapshot> tickers, size_t top_tickers) {
+    TickerMetricsSnapshot total{};
+    for (const TickerMetricsSnapshot& ticker : tickers) {
+        total.orders_added += ticker.orders_added;
+        total.fills += ticker.fills;
+        total.partial_fills += ticker.partial_fills;
+        total.orders_killed += ticker.orders_killed;
+        total.match_iterations += ticker.match_iterations;
+        total.lock_acquisitions += ticker.lock_acquisitions;
+        total.lock_contended += ticker.lock_contended;
+        total.lock_wait_cycles += ticker.lock_wait_cycles;
+        total.bid_levels += ticker.bid_levels;
+        total.ask_levels += ticker.ask_levels;
+        total.lock_spins.add(ticker.lock_spins);
+        total.lock_wait.add(ticker.lock_wait);
+    }
+    Log2Summary insert_cycles, match_cycles;
+    MetricsRegistry::instance().collect(insert_cycles, match_cycles);
+    double rate = cycles_per_ns();
+
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "metrics: %zu tickers, %llu orders, %llu fills (%llu partial), %llu killed, %llu match iterations, "
+                  "%llu bid levels, %llu ask levels\n",
+                  tickers.size(), static_cast<unsigned long long>(total.orders_added),
+                  static_cast<unsigned long long>(total.fills), static_cast<unsigned long long>(total.partial_fills),
+                  static_cast<unsigned long long>(total.orders_killed),
+                  static_cast<unsigned long long>(total.match_iterations),
+                  static_cast<unsigned long long>(total.bid_levels), static_cast<unsigned long long>(total.ask_levels));
+    out << line;
+    std::snprintf(line, sizeof(line), "locks: %llu acquisitions, %llu contended (%.2f%%), spins p99 %llu, wait p50 %.0f ns p99 %.0f ns\n",
+                  static_cast<unsigned long long>(total.lock_acquisitions),
+                  static_cast<unsigned long long>(total.lock_contended),
+                  total.lock_acquisitions ? 100.0 * total.lock_contended / total.lock_acquisitions : 0.0,
+                  static_cast<unsigned long long>(total.lock_spins.percentile(99.0)),
+                  total.lock_wait.percentile(50.0) / rate, total.lock_wait.percentile(99.0) / rate);
+    out << line;
+    std::snprintf(line, sizeof(line), "timing: insert p50 %.0f ns p99 %.0f ns, match p50 %.0f ns p99 %.0f ns\n",
+                  insert_cycles.percentile(50.0) / rate, insert_cycles.percentile(99.0) / rate,
+                  match_cycles.percentile(50.0) / rate, match_cycles.percentile(99.0) / rate);
+    out << line;
+
+    size_t shown = std::min(top_tickers, tickers.size());
+    std::partial_sort(tickers.begin(), tickers.begin() + shown, tickers.end(),
+                      [](const TickerMetricsSnapshot& a, const TickerMetricsSnapshot& b) {
+                          return a.lock_wait_cycles > b.lock_wait_cycles;
+                      });
+    if (shown > 0) {
+        std::snprintf(line, sizeof(line), "%-8s %10s %10s %12s %12s %10s %10s\n", "ticker", "orders", "contended",
+                      "wait us", "wait p99 ns", "bid lvls", "ask lvls");
+        out << line;
+    }
+    for (size_t i = 0; i < shown; i++) {
+        const TickerMetricsSnapshot& ticker = tickers[i];
+        std::snprintf(line, sizeof(line), "%-8d %10llu %10llu %12.1f %12.0f %10llu %10llu\n", ticker.ticker,
+                      static_cast<unsigned long long>(ticker.orders_added),
+                      static_cast<unsigned long long>(ticker.lock_contended), ticker.lock_wait_cycles / rate / 1000.0,
+                      ticker.lock_wait.percentile(99.0) / rate, static_cast<unsigned long long>(ticker.bid_levels),
+                      static_cast<unsigned long long>(ticker.ask_levels));
+        out << line;
+    }
+    out.flush();
+}
+
+/*
+ * TickerMemory is the memory held by one ticker's book: the TickerBook itself,
+ * its node pool's slabs and its level storage (level slab or ladder band).
+ */
+
+struct TickerMemory {
+    int32_t ticker;
+    size_t live_nodes;
+    size_t pool_nodes;
+    size_t pool_bytes;
+    size_t level_bytes;
+    size_t book_bytes;
+
+    size_t total_bytes() const {
+        return book_bytes + pool_bytes + level_bytes;
+    }
+};
+
+/*
+ * Print a memory report: per-ticker totals and averages, the engine-wide
+ * structures (order index, symbol table, book chunk table) in shared_bytes,
+ * and the top_tickers largest books.
+ */
+
+inline void print_memory_report(std::ostream& out, std::vector<TickerMemory> tickers, size_t shared_bytes,
+                                size_t top_tickers) {
+    TickerMemory total{};
+    for (const TickerMemory& ticker : tickers) {
+        total.live_nodes += ticker.live_nodes;
+        total.pool_nodes += ticker.pool_nodes;
+        total.pool_bytes += ticker.pool_bytes;
+        total.level_bytes += ticker.level_bytes;
+        total.book_bytes += ticker.book_bytes;
+    }
+    char line[256];
+    std::snprintf(line, sizeof(line),
+                  "memory: %zu tickers, %zu bytes in books (%zu pool, %zu levels, %zu headers), %zu shared, "
+                  "%.0f bytes/ticker, %zu of %zu nodes live\n",
+                  tickers.size(), total.total_bytes(), total.pool_bytes, total.level_bytes, total.book_bytes,
+                  shared_bytes, tickers.empty() ? 0.0 : static_cast<double>(total.total_bytes()) / tickers.size(),
+                  total.live_nodes, total.pool_nodes);
+    out << line;
+
+    size_t shown = std::min(top_tickers, tickers.size());
+    std::partial_sort(tickers.begin(), tickers.begin() + shown, tickers.end(),
+                      [](const TickerMemory& a, const TickerMemory& b) { return a.total_bytes() > b.total_bytes(); });
+    if (shown > 0) {
+        std::snprintf(line, sizeof(line), "%-8s %12s %10s %10s %12s\n", "ticker", "bytes", "live", "nodes",
+                      "level bytes");
+        out << line;
+    }
+    for (size_t i = 0; i < shown; i++) {
+        const TickerMemory& ticker = tickers[i];
+        std::snprintf(line, sizeof(line), "%-8d %12zu %10zu %10zu %12zu\n", ticker.ticker, ticker.total_bytes(),
+                      ticker.live_nodes, ticker.pool_nodes, ticker.level_bytes);
+        out << line;
+    }
+    out.flush();
+}
+
+/*
+ * OrderIdSource hands out order IDs in blocks, so the shared counter is touched
+ * once per block_size IDs instead of once per order.
+ * - A Block is a reserved range owned by one ticker and used under its lock, which
+ *   also makes IDs increase within the ticker.
+ * - IDs stay unique, and dense apart from the unused tail of each live block,
+ *   so they spread evenly over the OrderIndex slots.
+ * - high_water() is above every ID handed out so far.
+ */
+
+#ifndef STOCK_ENGINE_ORDER_ID_BLOCK
+#define STOCK_ENGINE_ORDER_ID_BLOCK 64
+#endif
+
+class OrderIdSource {
+public:
+    static constexpr uint64_t block_size = STOCK_ENGINE_ORDER_ID_BLOCK;
+    static_assert(block_size > 0, "STOCK_ENGINE_ORDER_ID_BLOCK must be positive");
+
+    struct Block {
+        uint64_t next = 0;
+        uint64_t end = 0;
+    };
+
+private:
+    alignas(64) std::atomic<uint64_t> next_free;
+
+public:
+    OrderIdSource() : next_free(0) {}
+
+    OrderIdSource(const OrderIdSource&) = delete;
+    OrderIdSource& operator=(const OrderIdSource&) = delete;
+
+    // Next ID from a block, refilling it when used up.
+    uint64_t take(Block& block) {
+        if (block.next == block.end) {
+            block.next = next_free.fetch_add(block_size, std::memory_order_relaxed);
+            block.end = block.next + block_size;
+        }
+        return block.next++;
+    }
+
+    // count contiguous IDs straight from the counter, returning the first.
+    uint64_t reserve(uint64_t count) {
+        return next_free.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    uint64_t high_water() const {
+        return next_free.load(std::memory_order_relaxed);
+    }
+
+    // Makes every later ID at least id, e.g. after restoring a snapshot.
+    void advance_to(uint64_t id) {
+        uint64_t current = next_free.load(std::memory_order_relaxed);
+        while (current < id && !next_free.compare_exchange_weak(current, id, std::memory_order_relaxed));
+    }
+};
+
+/*
+ * OrderIndex maps an order ID to where the order rests, in O(1).
+ * - Order IDs are handed out densely, so an ID keys a fixed table of slots directly
+ *   (id modulo the slot count) instead of a hash. Memory is set by the slot count,
+ *   not by how many IDs were ever issued, and IDs may use the full 64 bits.
+ * - Each entry records the order ID that holds it. A free entry is claimed with one
+ *   CAS on ticker_index, so two tickers can never both take an entry.
+ * - An order whose entry is still held by an order at least slot-count IDs older
+ *   goes to an open-addressed overflow table, probed on the order ID and claimed
+ *   with the same CAS, so overflow lookups take no lock either. That only happens
+ *   for long-resting orders, and the overflow is skipped by a counter check while
+ *   it is empty. A full overflow table chains a twice-larger one behind it.
+ * - ticker_index and order_id are atomic so a canceller can find the owning ticker
+ *   without a lock. node is only read or written under that ticker's lock, after
+ *   node_of() has checked the entry still belongs to the order and that ticker.
+ * - Chunks of the table are allocated on first use and are reused, never freed, so
+ *   lock-free readers never touch freed memory.
+ */
+
+#ifndef STOCK_ENGINE_ORDER_INDEX_SLOTS
+#define STOCK_ENGINE_ORDER_INDEX_SLOTS (size_t(1) << 20)
+#endif
+
+class OrderIndex {
+private:
+    struct Entry {
+        std::atomic<uint64_t> order_id{0};
+        // -1 free, -2 being claimed, otherwise the owning ticker slot.
+        std::atomic<int32_t> ticker_index{-1};
+        Node* node = nullptr;
+    };
+
+    /*
+     * One open-addressed overflow table. Inserts probe at most overflow_probe_limit
+     * entries from the ID's home and record the longest probe they used, so a lookup
+     * of an absent ID stops after max_probe entries instead of scanning the table.
+     */
+    struct OverflowTable {
+        std::unique_ptr<Entry[]> entries;
+        size_t mask;
+        std::atomic<size_t> max_probe{0};
+        std::atomic<OverflowTable*> next{nullptr};
+
+        explicit OverflowTable(size_t size) : entries(new Entry[size]), mask(size - 1) {}
+
+        size_t home(uint64_t order_id) const {
+            return static_cast<size_t>((order_id * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+        }
+    };
+
+    static constexpr int32_t free_entry = -1;
+    static constexpr int32_t claimed_entry = -2;
+    static constexpr uint64_t slot_count = STOCK_ENGINE_ORDER_INDEX_SLOTS;
+    static_assert(slot_count >= 1024 && (slot_count & (slot_count - 1)) == 0,
+                  "STOCK_ENGINE_ORDER_INDEX_SLOTS must be a power of two of at least 1024");
+    static constexpr uint64_t chunk_size = std::min<uint64_t>(slot_count, uint64_t(1) << 16);
+    static constexpr uint64_t chunk_count = slot_count / chunk_size;
+    static constexpr size_t overflow_initial_size = 1024;
+    static constexpr size_t overflow_probe_limit = 32;
+
+    std::unique_ptr<std::atomic<Entry*>[]> chunks;
+    // Allocated on the first spill; like the chunks, tables are only freed with the index.
+    std::atomic<OverflowTable*> overflow;
+    std::atomic<size_t> overflow_count;
+
+    Entry* entry_if_allocated(uint64_t order_id) const {
+        uint64_t slot = order_id & (slot_count - 1);
+        Entry* entries = chunks[slot / chunk_size].load(std::memory_order_acquire);
+        return entries ? &entries[slot % chunk_size] : nullptr;
+    }
+
+    Entry& entry(uint64_t order_id) {
+        uint64_t slot = order_id & (slot_count - 1);
+        std::atomic<Entry*>& chunk = chunks[slot / chunk_size];
+        Entry* entries = chunk.load(std::memory_order_acquire);
+        if (!entries) {
+            Entry* fresh = new Entry[chunk_size];
+            if (chunk.compare_exchange_strong(entries, fresh, std::memory_order_acq_rel)) {
+                entries = fresh;
+            } else {
+                delete[] fresh;
+            }
+        }
+        return entries[slot % chunk_size];
+    }
+
+    // Whether the entry is held by this order; stable while its ticker's lock is held.
+    static bool holds(const Entry& entry, uint64_t order_id) {
+        return entry.ticker_index.load(std::memory_order_acquire) >= 0
+            && entry.order_id.load(std::memory_order_acquire) == order_id;
+    }
+
+    bool has_overflow() const {
+        return overflow_count.load(std::memory_order_acquire) > 0;
+    }
+
+    // The overflow entry held by this order, or nullptr.
+    Entry* find_overflow(uint64_t order_id) const {
+        for (OverflowTable* table = overflow.load(std::memory_order_acquire); table;
+             table = table->next.load(std::memory_order_acquire)) {
+            size_t probes = table->max_probe.load(std::memory_order_acquire);
+            size_t home = table->home(order_id);
+            for (size_t i = 0; i <= probes; i++) {
+                Entry& candidate = table->entries[(home + i) & table->mask];
+                if (holds(candidate, order_id)) {
+                    return &candidate;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Table after link, creating it (twice link's size) if no other thread has yet.
+    static OverflowTable* next_table(std::atomic<OverflowTable*>& link, size_t size) {
+        OverflowTable* table = link.load(std::memory_order_acquire);
+        if (!table) {
+            OverflowTable* fresh = new OverflowTable(size);
+            if (link.compare_exchange_strong(table, fresh, std::memory_order_acq_rel)) {
+                table = fresh;
+            } else {
+                delete fresh;
+            }
+        }
+        return table;
+    }
+
+    void insert_overflow(uint64_t order_id, int32_t ticker_index, Node* node) {
+        std::atomic<OverflowTable*>* link = &overflow;
+        size_t size = overflow_initial_size;
+        for (;;) {
+            OverflowTable* table = next_table(*link, size);
+            size_t home = table->home(order_id);
+            for (size_t i = 0; i < overflow_probe_limit; i++) {
+                Entry& candidate = table->entries[(home + i) & table->mask];
+                int32_t expected = free_entry;
+                if (!candidate.ticker_index.compare_exchange_strong(expected, claimed_entry,
+                                                                    std::memory_order_acquire)) {
+                    continue;
+                }
+                size_t probes = table->max_probe.load(std::memory_order_relaxed);
+                while (probes < i
+                       && !table->max_probe.compare_exchange_weak(probes, i, std::memory_order_release));
+                candidate.order_id.store(order_id, std::memory_order_relaxed);
+                candidate.node = node;
+                candidate.ticker_index.store(ticker_index, std::memory_order_release);
+                overflow_count.fetch_add(1, std::memory_order_release);
+                return;
+            }
+            link = &table->next;
+            size = (table->mask + 1) * 2;
+        }
+    }
+
+public:
+    OrderIndex() : chunks(new std::atomic<Entry*>[chunk_count]), overflow(nullptr), overflow_count(0) {
+        for (uint64_t i = 0; i < chunk_count; i++) {
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~OrderIndex() {
+        for (uint64_t i = 0; i < chunk_count; i++) {
+            delete[] chunks[i].load(std::memory_order_relaxed);
+        }
+        OverflowTable* table = overflow.load(std::memory_order_relaxed);
+        while (table) {
+            OverflowTable* next = table->next.load(std::memory_order_relaxed);
+            delete table;
+            table = next;
+        }
+    }
+
+    OrderIndex(const OrderIndex&) = delete;
+    OrderIndex& operator=(const OrderIndex&) = delete;
+
+    // Heap bytes of the chunk table, every chunk allocated so far and the overflow tables.
+    size_t bytes() const {
+        size_t total = chunk_count * sizeof(chunks[0]);
+        for (uint64_t i = 0; i < chunk_count; i++) {
+            if (chunks[i].load(std::memory_order_relaxed)) {
+                total += chunk_size * sizeof(Entry);
+            }
+        }
+        for (OverflowTable* table = overflow.load(std::memory_order_acquire); table;
+             table = table->next.load(std::memory_order_acquire)) {
+            total += sizeof(OverflowTable) + (table->mask + 1) * sizeof(Entry);
+        }
+        return total;
+    }
+
+    // Resting orders that did not fit their slot.
+    size_t overflow_size() const {
+        return overflow_count.load(std::memory_order_relaxed);
+    }
+
+    /*
+     * Ticker slot an order rests on, or -1, read without any ticker lock. The answer
+     * may be stale by the time the lock is taken, so confirm it with node_of.
+     */
+    int32_t ticker_of(uint64_t order_id) const {
+        const Entry* found = entry_if_allocated(order_id);
+        if (found) {
+            int32_t ticker_index = found->ticker_index.load(std::memory_order_acquire);
+            if (ticker_index >= 0 && found->order_id.load(std::memory_order_acquire) == order_id) {
+                return ticker_index;
+            }
+        }
+        if (!has_overflow()) {
+            return -1;
+        }
+        const Entry* spilled = find_overflow(order_id);
+        return spilled ? spilled->ticker_index.load(std::memory_order_acquire) : -1;
+    }
+
+    // Resting node of an order on ticker_index, or nullptr. The caller holds that ticker's lock.
+    Node* node_of(uint64_t order_id, int32_t ticker_index) const {
+        const Entry* found = entry_if_allocated(order_id);
+        if (found && holds(*found, order_id)) {
+            return found->ticker_index.load(std::memory_order_relaxed) == ticker_index ? found->node : nullptr;
+        }
+        if (!has_overflow()) {
+            return nullptr;
+        }
+        const Entry* spilled = find_overflow(order_id);
+        return spilled && spilled->ticker_index.load(std::memory_order_relaxed) == ticker_index ? spilled->node
+                                                                                               : nullptr;
+    }
+
+    // Records a resting order, or moves it to a new node. The caller holds the ticker lock.
+    void publish(uint64_t order_id, int32_t ticker_index, Node* node) {
+        Entry& slot = entry(order_id);
+        if (holds(slot, order_id)) {
+            slot.node = node;
+            return;
+        }
+        if (has_overflow()) {
+            Entry* spilled = find_overflow(order_id);
+            if (spilled) {
+                spilled->node = node;
+                return;
+            }
+        }
+        int32_t expected = free_entry;
+        if (slot.ticker_index.compare_exchange_strong(expected, claimed_entry, std::memory_order_acquire)) {
+            slot.order_id.store(order_id, std::memory_order_relaxed);
+            slot.node = node;
+            slot.ticker_index.store(ticker_index, std::memory_order_release);
+            return;
+        }
+        insert_overflow(order_id, ticker_index, node);
+    }
+
+    // Forgets an order that was filled or cancelled. The caller holds the ticker lock.
+    void clear(uint64_t order_id) {
+        Entry* slot = entry_if_allocated(order_id);
+        if (slot && holds(*slot, order_id)) {
+            slot->node = nullptr;
+            slot->ticker_index.store(free_entry, std::memory_order_release);
+            return;
+        }
+        if (has_overflow()) {
+            Entry* spilled = find_overflow(order_id);
+            if (spilled) {
+                spilled->node = nullptr;
+                spilled->ticker_index.store(free_entry, std::memory_order_release);
+                overflow_count.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    }
+};
+
+/*
+ * SymbolTable maps external ticker ids to dense book slots.
+ * - Slots are handed out 0, 1, 2, ... in order of first use, so the books of a
+ *   sparse id universe still sit back to back and memory follows active symbols.
+ * - The table is open-addressed and sized once for max_symbols; lookups are
+ *   lock-free probes and a new ticker claims its entry with a CAS.
+ * - The claiming thread initializes the slot before publishing it; a racing
+ *   lookup of the same ticker waits for the publish rather than seeing a half-built book.
+ */
+
+class SymbolTable {
+private:
+    static constexpr int32_t pending_slot = -1;
+    static constexpr int32_t failed_slot = -2;
+
+    struct Entry {
+        std::atomic<int64_t> key{-1};
+        std::atomic<int32_t> slot{pending_slot};
+    };
+
+    std::unique_ptr<Entry[]> entries;
+    std::unique_ptr<std::atomic<int32_t>[]> tickers;
+    size_t mask;
+    size_t symbol_capacity;
+    std::atomic<int32_t> next_slot{0};
+
+    size_t home(int32_t ticker) const {
+        return static_cast<size_t>((static_cast<uint64_t>(ticker) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    }
+
+public:
+    explicit SymbolTable(size_t max_symbols) : symbol_capacity(max_symbols) {
+        if (max_symbols == 0 || max_symbols > static_cast<size_t>(INT32_MAX) / 2) {
+            throw std::invalid_argument("max_symbols out of range");
+        }
+        // At most half full, so probe sequences stay short.
+        size_t size = 2;
+        while (size < max_symbols * 2) {
+            size <<= 1;
+        }
+        entries.reset(new Entry[size]);
+        mask = size - 1;
+        tickers.reset(new std::atomic<int32_t>[max_symbols]);
+        for (size_t i = 0; i < max_symbols; i++) {
+            tickers[i].store(-1, std::memory_order_relaxed);
+        }
+    }
+
+    SymbolTable(const SymbolTable&) = delete;
+    SymbolTable& operator=(const SymbolTable&) = delete;
+
+    size_t capacity() const {
+        return symbol_capacity;
+    }
+
+    // Heap bytes of the hash table and the reverse map.
+    size_t bytes() const {
+        return (mask + 1) * sizeof(Entry) + symbol_capacity * sizeof(tickers[0]);
+    }
+
+    // Slots claimed so far; a slot below this may still be initializing (ticker_of returns -1).
+    size_t size() const {
+        return std::min(static_cast<size_t>(next_slot.load(std::memory_order_acquire)), symbol_capacity);
+    }
+
+    // External ticker of a published slot, or -1.
+    int32_t ticker_of(size_t slot) const {
+        return tickers[slot].load(std::memory_order_acquire);
+    }
+
+    // Slot of a ticker that has been seen before, or -1.
+    int32_t find(int32_t ticker) const {
+        if (ticker < 0) {
+            return -1;
+        }
+        size_t pos = home(ticker);
+        for (size_t probes = 0; probes <= mask; probes++, pos = (pos + 1) & mask) {
+            int64_t key = entries[pos].key.load(std::memory_order_acquire);
+            if (key == ticker) {
+                int32_t slot = entries[pos].slot.load(std::memory_order_acquire);
+                return slot < 0 ? -1 : slot;
+            }
+            if (key < 0) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    /*
+     * Slot of a ticker, claiming the next free slot on first use.
+     * init(slot) runs exactly once per ticker, on the claiming thread, before the
+     * slot becomes visible to lookups.
+     * Once every slot is claimed new tickers throw std::length_error without taking a
+     * hash entry; only tickers racing for the last slots can leave a failed entry behind,
+     * and every probe is bounded by the table size.
+     */
+    template <typename Init>
+    int32_t find_or_insert(int32_t ticker, Init init) {
+        if (ticker < 0) {
+            throw std::invalid_argument("ticker must be non-negative");
+        }
+        size_t pos = home(ticker);
+        for (size_t probes = 0; probes <= mask; probes++, pos = (pos + 1) & mask) {
+            Entry& entry = entries[pos];
+            int64_t key = entry.key.load(std::memory_order_acquire);
+            if (key < 0) {
+                if (next_slot.load(std::memory_order_acquire) >= static_cast<int32_t>(symbol_capacity)) {
+                    throw std::length_error("symbol table is full");
+                }
+                if (!entry.key.compare_exchange_strong(key, ticker, std::memory_order_acq_rel)) {
+                    if (key != ticker) {
+                        continue;
+                    }
+                } else {
+                    int32_t slot = next_slot.fetch_add(1);
+                    if (slot >= static_cast<int32_t>(symbol_capacity)) {
+                        // The entry stays claimed but failed, so this ticker is rejected from now on.
+                        entry.slot.store(failed_slot, std::memory_order_release);
+                        throw std::length_error("symbol table is full");
+                    }
+                    init(slot);
+                    tickers[slot].store(ticker, std::memory_order_release);
+                    entry.slot.store(slot, std::memory_order_release);
+                    return slot;
+                }
+            } else if (key != ticker) {
+                continue;
+            }
+            int32_t slot;
+            while ((slot = entry.slot.load(std::memory_order_acquire)) == pending_slot) {
+                cpu_relax();
+            }
+            if (slot == failed_slot) {
+                throw std::length_error("symbol table is full");
+            }
+            return slot;
+        }
+        throw std::length_error("symbol table is full");
+    }
+};
+
+/*
+ * TopOfBook is a consistent best bid/ask quote for one ticker.
+ * A side with no resting orders has a size of zero. sequence counts the quote
+ * updates published for the ticker.
+ */
+
+struct TopOfBook {
+    Price bid_price;
+    Price ask_price;
+    uint64_t bid_size;
+    uint64_t ask_size;
+    uint64_t sequence;
+};
+
+struct TickerQuote {
+    int32_t ticker;
+    TopOfBook quote;
+};
+
+/*
+ * QuoteSeqlock publishes a ticker's TopOfBook to lock-free readers.
+ * - The single writer (whoever holds the ticker lock) bumps the sequence to odd,
+ *   stores the fields, then bumps it back to even.
+ * - Readers retry until they see the same even sequence before and after the read,
+ *   so they never block or slow the matcher beyond sharing the cache line.
+ * Fields are relaxed atomics so concurrent reads are well defined.
+ */
+
+class alignas(64) QuoteSeqlock {
+private:
+    std::atomic<uint64_t> sequence{0};
+    std::atomic<Price> bid_price{0};
+    std::atomic<Price> ask_price{0};
+    std::atomic<uint64_t> bid_size{0};
+    std::atomic<uint64_t> ask_size{0};
+
+public:
+    // Publishes a new quote; unchanged quotes are skipped so readers only see real updates.
+    void publish(Price bid, uint64_t bid_quantity, Price ask, uint64_t ask_quantity) {
+        if (bid_price.load(std::memory_order_relaxed) == bid && bid_size.load(std::memory_order_relaxed) == bid_quantity
+            && ask_price.load(std::memory_order_relaxed) == ask && ask_size.load(std::memory_order_relaxed) == ask_quantity) {
+            return;
+        }
+        uint64_t seq = sequence.load(std::memory_order_relaxed);
+        sequence.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bid_price.store(bid, std::memory_order_relaxed);
+        bid_size.store(bid_quantity, std::memory_order_relaxed);
+        ask_price.store(ask, std::memory_order_relaxed);
+        ask_size.store(ask_quantity, std::memory_order_relaxed);
+        sequence.store(seq + 2, std::memory_order_release);
+    }
+
+    TopOfBook read() const {
+        TopOfBook quote;
+        for (;;) {
+            uint64_t before = sequence.load(std::memory_order_acquire);
+            if (before & 1) {
+                cpu_relax();
+                continue;
+            }
+            quote.bid_price = bid_price.load(std::memory_order_relaxed);
+            quote.bid_size = bid_size.load(std::memory_order_relaxed);
+            quote.ask_price = ask_price.load(std::memory_order_relaxed);
+            quote.ask_size = ask_size.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+                quote.sequence = before / 2;
+                return quote;
+            }
+        }
+    }
+};
+
+/*
+ * TickerBook groups everything one ticker needs on the matching path:
+ * its lock, node pool, depth emitter, both sides of the book, its published quote
+ * and its metrics.
+ * It is aligned to a cache line so threads trading different tickers never
+ * share (and keep invalidating) the same line.
+ */
+
+template <typename LockPolicy, template <Side> class SideBook = PriceLevelBook>
+struct alignas(64) TickerBook {
+    LockPolicy lock;
+    // Declared before the books so both sides are destroyed before their pool.
+    NodePool pool;
+    DepthEmitter depth;
+    SideBook<Side::Buy> buy_orders;
+    SideBook<Side::Sell> sell_orders;
+    // On its own cache line so quote readers do not contend with the lock.
+    QuoteSeqlock quote;
+    // Written by the lock holder only, after the quote so exporters never touch the lock's line.
+    TickerMetrics metrics;
+    // IDs reserved for this ticker's orders, taken under the lock.
+    OrderIdSource::Block ids;
+    // Pool churn seen by the last compaction pass; unchanged means the ticker is quiet.
+    uint64_t compaction_mark = 0;
+    // In an auction call phase: orders rest without matching until the uncross.
+    bool in_auction = false;
+    // Last market-wide auction this ticker joined, so it joins each one once.
+    uint64_t auction_joined = 0;
+
+    TickerBook() : buy_orders(&pool, &depth), sell_orders(&pool, &depth) {}
+
+    // The book of one side, resolved at compile time.
+    template <Side BookSide>
+    SideBook<BookSide>& side() {
+        if constexpr (BookSide == Side::Buy) {
+            return buy_orders;
+        } else {
+            return sell_orders;
+        }
+    }
+};
+
+/*
+ * Book snapshot file layout: a SnapshotHeader, then for every ticker slot a
+ * SnapshotTickerHeader followed by its buy orders and then its sell orders as
+ * packed Order records, each side ordered from worst level to best.
+ */
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t ticker_count;
+    uint64_t next_order_id;
+};
+
+struct SnapshotTickerHeader {
+    int32_t ticker;
+    uint32_t buy_count;
+    uint32_t sell_count;
+};
+
+constexpr char snapshot_magic[8] = {'S', 'T', 'E', 'S', 'N', 'A', 'P', 'S'};
+constexpr uint32_t snapshot_version = 2;
+
+/*
+ * OrderAck describes what happened to one submitted order.
+ * - fills lists its executions in match order; filled_quantity is their total.
+ * - resting_quantity is what was left on the book (Limit orders only).
+ * - Cancelled means an IOC/market remainder was dropped or a fill-or-kill order
+ *   was killed; Rejected means the engine refused the order, with the reason.
+ */
+
+enum class OrderStatus : uint8_t {
+    Resting,
+    Filled,
+    Cancelled,
+    Rejected
+};
+
+struct OrderAck {
+    uint64_t order_id = 0;
+    int32_t ticker = 0;
+    OrderStatus status = OrderStatus::Rejected;
+    uint32_t filled_quantity = 0;
+    uint32_t resting_quantity = 0;
+    std::vector<Execution> fills;
+    std::string reason;
+};
+
+// Completion callback for asynchronous submission; context is passed through untouched.
+using AckCallback = void (*)(const OrderAck& ack, void* context);
+
+/*
+ * AuctionResult is the outcome of uncrossing one ticker's auction.
+ * - price is the single clearing price every auction fill traded at (0 with no cross).
+ * - volume is the quantity executed, the most any single price could execute.
+ * - imbalance is buy interest minus sell interest left unmatched at that price.
+ */
+
+struct AuctionResult {
+    int32_t ticker = 0;
+    Price price = 0;
+    uint64_t volume = 0;
+    int64_t imbalance = 0;
+};
+
+/*
+ * WorkStealingPool runs parallel_for(count, task) over a fixed set of threads.
+ * - [0, count) is split into one contiguous range per worker, packed as begin/end in
+ *   a single atomic word. A worker takes indices from the front of its own range and,
+ *   once that is empty, steals the back half of another worker's range with one CAS.
+ * - Uneven tasks, such as a deep crossed book next to empty ones, rebalance without a
+ *   shared queue, and neighbouring indices mostly stay on one worker.
+ * - The calling thread works as worker 0; helper threads sleep between calls.
+ * Tasks must not throw, and parallel_for calls must not overlap or nest.
+ */
+
+class WorkStealingPool {
+private:
+    struct alignas(64) Worker {
+        std::atomic<uint64_t> range{0};
+    };
+
+    std::unique_ptr<Worker[]> workers;
+    size_t worker_count;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    uint64_t generation;
+    size_t running;
+    bool stopping;
+    void (*job)(void* context, size_t index);
+    void* job_context;
+    std::atomic<uint64_t> steal_count;
+
+    static uint64_t pack(uint64_t begin, uint64_t end) {
+        return begin << 32 | end;
+    }
+
+    // Takes the next index of the worker's own range.
+    static bool take(Worker& worker, size_t& index) {
+        uint64_t range = worker.range.load(std::memory_order_acquire);
+        while ((range >> 32) < (range & 0xffffffffu)) {
+            if (worker.range.compare_exchange_weak(range, range + (uint64_t(1) << 32), std::memory_order_acq_rel,
+                                                   std::memory_order_acquire)) {
+                index = static_cast<size_t>(range >> 32);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Moves the back half of the first non-empty victim range into self's (empty) range.
+    bool steal(size_t self) {
+        for (size_t offset = 1; offset < worker_count; offset++) {
+            Worker& victim = workers[(self + offset) % worker_count];
+            uint64_t range = victim.range.load(std::memory_order_acquire);
+            while ((range >> 32) < (range & 0xffffffffu)) {
+                uint64_t begin = range >> 32;
+                uint64_t end = range & 0xffffffffu;
+                uint64_t middle = begin + (end - begin) / 2;
+                if (victim.range.compare_exchange_weak(range, pack(begin, middle), std::memory_order_acq_rel,
+                                                       std::memory_order_acquire)) {
+                    workers[self].range.store(pack(middle, end), std::memory_order_release);
+                    steal_count.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void work(size_t self) {
+        size_t index;
+        do {
+            while (take(workers[self], index)) {
+                job(job_context, index);
+            }
+        } while (steal(self));
+    }
+
+    void run(size_t self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            work(self);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+public:
+    explicit WorkStealingPool(size_t thread_count = std::thread::hardware_concurrency())
+        : worker_count(std::max<size_t>(thread_count, 1)), generation(0), running(0), stopping(false), job(nullptr),
+          job_context(nullptr), steal_count(0) {
+        workers.reset(new Worker[worker_count]);
+        for (size_t i = 1; i < worker_count; i++) {
+            threads.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Worker count, including the calling thread.
+    size_t size() const {
+        return worker_count;
+    }
+
+    // Ranges stolen since construction.
+    uint64_t steals() const {
+        return steal_count.load(std::memory_order_relaxed);
+    }
+
+    // Calls task(index) once for every index in [0, count) and returns when all have run.
+    template <typename Task>
+    void parallel_for(size_t count, Task& task) {
+        if (count == 0) {
+            return;
+        }
+        if (count > 0xffffffffu) {
+            throw std::length_error("parallel_for range exceeds 2^32 tasks");
+        }
+        for (size_t i = 0; i < worker_count; i++) {
+            workers[i].range.store(pack(count * i / worker_count, count * (i + 1) / worker_count),
+                                   std::memory_order_relaxed);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = [](void* context, size_t index) { (*static_cast<Task*>(context))(index); };
+            job_context = &task;
+            running = worker_count - 1;
+            generation++;
+        }
+        wake.notify_all();
+        work(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [this]() { return running == 0; });
+    }
+};
+
+/*
+ * OrderBook class manages stock transactions and order matching.
+ * - It maintains two price-level books per stock ticker (one for buy orders, one for sell orders).
+ * - Guards each ticker with a LockPolicy lock (a backoff spinlock by default).
+ * - Each ticker's lock and books live in their own cache-line-aligned TickerBook.
+ * - Tickers are any non-negative id; a SymbolTable gives each one a dense slot and
+ *   its TickerBook is allocated on its first order, in chunks of adjacent slots.
+ * - SideBook picks the per-side book: sorted PriceLevelBook levels (the default) or the
+ *   dense PriceLadderBook for liquid tickers in a bounded band (see LadderOrderBook).
+ * - Orders are added to the respective queue and matched in real-time if conditions allow.
+ */
+
+template <typename LockPolicy = DefaultLockPolicy, template <Side> class SideBook = PriceLevelBook>
+class OrderBook {
+private:
+    using Book = TickerBook<LockPolicy, SideBook>;
+    static constexpr size_t book_chunk_bits = 6;
+    static constexpr size_t book_chunk_size = size_t(1) << book_chunk_bits;
+
+    SymbolTable symbols;
+    std::unique_ptr<std::atomic<Book*>[]> book_chunks;
+    size_t book_chunk_count;
+    size_t nodes_per_ticker;
+    OrderIndex order_index;
+    OrderIdSource order_ids;
+    ExecutionReporter* reporter;
+    OrderLogSink* order_log;
+    DepthFeed* depth_feed;
+    // Market-wide auction currently in its call phase, or 0; tickers join it under their lock.
+    std::atomic<uint64_t> auction_call;
+    uint64_t auction_sessions;
+
+public:
+    static constexpr size_t default_max_symbols = 1 << 15;
+
+    /*
+     * nodes_per_ticker preallocates that many resting-order nodes for each ticker when
+     * its book is created, shared between its buy and sell sides. Pools still grow on
+     * demand beyond it. max_symbols bounds the number of distinct tickers, not their ids.
+     */
+    explicit OrderBook(size_t nodes_per_ticker = 0, size_t max_symbols = default_max_symbols)
+        : symbols(max_symbols), book_chunk_count((max_symbols + book_chunk_size - 1) >> book_chunk_bits),
+          nodes_per_ticker(nodes_per_ticker), reporter(nullptr), order_log(nullptr), depth_feed(nullptr),
+          auction_call(0), auction_sessions(0) {
+        book_chunks.reset(new std::atomic<Book*>[book_chunk_count]);
+        for (size_t i = 0; i < book_chunk_count; i++) {
+            book_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~OrderBook() {
+        for (size_t i = 0; i < book_chunk_count; i++) {
+            delete[] book_chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    OrderBook(const OrderBook&) = delete;
+    OrderBook& operator=(const OrderBook&) = delete;
+
+    // Number of tickers that have a book.
+    size_t ticker_count() const {
+        return symbols.size();
+    }
+
+    /*
+     * Add a new order to the book and match it against the opposite side.
+     * - The incoming order is matched aggressively before it rests, all under a
+     *   single acquisition of the ticker lock.
+     * - Only an unfilled remainder of a Limit order is inserted into its own side of
+     *   the book; IOC and market remainders are dropped without touching the node pool,
+     *   and a fill-or-kill order that cannot fill completely leaves the book untouched.
+     * - With PriceLadderBook sides, a Limit price outside its side's band throws
+     *   std::out_of_range before the book changes.
+     * - The ID comes from the ticker's reserved block under its lock, so IDs increase
+     *   within a ticker and the shared ID counter is only touched once per block.
+     * - In an auction call phase (see begin_auction) nothing matches until the uncross.
+     * Returns the order ID assigned to it.
+     */
+
+    uint64_t add_order(Side side, int32_t ticker, uint32_t quantity, Price price, OrderType type = OrderType::Limit) {
+        int index = slot_for(ticker);
+        Book& book = book_at(index);
+
+        TickerLockGuard guard(book);
+        join_auction(book, ticker);
+        if (type == OrderType::Limit) {
+            require_in_band(book, side, price);
+        }
+        uint64_t order_id = order_ids.take(book.ids);
+        Order order(side, ticker, quantity, price, order_id, type);
+        log_order(OrderLogType::Add, order);
+        execute_and_rest(order, book, index);
+        publish_quote(book);
+        return order_id;
+    }
+
+    // Add an order whose ID was already assigned upstream (e.g. by ShardedEngine).
+    void add_order(Order order) {
+        int index = slot_for(order.ticker);
+        Book& book = book_at(index);
+
+        TickerLockGuard guard(book);
+        join_auction(book, order.ticker);
+        if (order.type == OrderType::Limit) {
+            require_in_band(book, order.side, order.price);
+        }
+        log_order(OrderLogType::Add, order);
+        execute_and_rest(order, book, index);
+        publish_quote(book);
+    }
+
+    /*
+     * Add an order like add_order(Order) and describe its outcome in ack, whose
+     * previous contents are replaced. Reusing one ack keeps its fills buffer, so
+     * steady-state acks do not allocate. Rejections throw as in add_order.
+     */
+
+    void submit_order(Order order, OrderAck& ack) {
+        ack.order_id = order.order_id;
+        ack.ticker = order.ticker;
+        ack.fills.clear();
+        ack.reason.clear();
+        int index = slot_for(order.ticker);
+        Book& book = book_at(index);
+
+        TickerLockGuard guard(book);
+        join_auction(book, order.ticker);
+        if (order.type == OrderType::Limit) {
+            require_in_band(book, order.side, order.price);
+        }
+        log_order(OrderLogType::Add, order);
+        uint32_t quantity = order.quantity;
+        execute_and_rest(order, book, index, &ack.fills);
+        publish_quote(book);
+
+        ack.filled_quantity = quantity - order.quantity;
+        ack.resting_quantity = order.type == OrderType::Limit ? order.quantity : 0;
+        if (ack.resting_quantity > 0) {
+            ack.status = OrderStatus::Resting;
+        } else {
+            ack.status = order.quantity == 0 ? OrderStatus::Filled : OrderStatus::Cancelled;
+        }
+    }
+
+    /*
+     * Write every resting order to a snapshot file.
+     * Each ticker is locked while it is copied out, so every ticker is internally
+     * consistent; quiesce order flow first if the whole book must be one point in time.
+     */
+
+    void snapshot(const std::string& path) {
+        FILE* file = std::fopen(path.c_str(), "wb");
+        if (!file) {
+            throw std::runtime_error("cannot open snapshot for writing: " + path);
+        }
+        SnapshotHeader header{};
+        std::memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+        header.version = snapshot_version;
+        // A slot still being created has no orders yet, so only published tickers are written.
+        std::vector<int32_t> slots;
+        for (size_t index = 0; index < symbols.size(); index++) {
+            if (symbols.ticker_of(index) >= 0) {
+                slots.push_back(static_cast<int32_t>(index));
+            }
+        }
+        header.ticker_count = static_cast<uint32_t>(slots.size());
+        header.next_order_id = order_ids.high_water();
+        // A short write (a full disk, say) stops the copy; the file is then reported as failed.
+        bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+
+        std::vector<Order> orders;
+        for (size_t i = 0; i < slots.size() && written; i++) {
+            int32_t index = slots[i];
+            Book& book = book_at(index);
+            SnapshotTickerHeader ticker_header{};
+            ticker_header.ticker = symbols.ticker_of(index);
+            orders.clear();
+            {
+                std::lock_guard<LockPolicy> guard(book.lock);
+                auto collect = [&orders](const Order& order) { orders.push_back(order); };
+                book.buy_orders.for_each_worst_to_best(collect);
+                ticker_header.buy_count = static_cast<uint32_t>(orders.size());
+                book.sell_orders.for_each_worst_to_best(collect);
+                ticker_header.sell_count = static_cast<uint32_t>(orders.size() - ticker_header.buy_count);
+            }
+            written = std::fwrite(&ticker_header, sizeof(ticker_header), 1, file) == 1
+                && std::fwrite(orders.data(), sizeof(Order), orders.size(), file) == orders.size();
+        }
+        written = written && !std::ferror(file);
+        if (std::fclose(file) != 0 || !written) {
+            throw std::runtime_error("failed to write snapshot: " + path);
+        }
+    }
+
+    /*
+     * Load a snapshot into this (empty) book.
+     * Orders are bulk-appended in the order they were written, so there is no
+     * sorted-insert cost, and the order ID counter resumes after the snapshot's.
+     * Throws std::logic_error if any ticker has resting orders or a reserved block of
+     * order IDs, since those IDs could repeat the snapshot's; restore before any flow.
+     */
+
+    void restore(const std::string& path) {
+        FILE* file = std::fopen(path.c_str(), "rb");
+        if (!file) {
+            throw std::runtime_error("cannot open snapshot for reading: " + path);
+        }
+        std::unique_ptr<FILE, int (*)(FILE*)> closer(file, &std::fclose);
+        for (size_t index = 0; index < symbols.size(); index++) {
+            if (symbols.ticker_of(index) < 0) {
+                continue;
+            }
+            Book& book = book_at(index);
+            TickerLockGuard guard(book);
+            if (!book.buy_orders.is_empty() || !book.sell_orders.is_empty()) {
+                throw std::logic_error("restore requires an empty book");
+            }
+            if (book.ids.next != book.ids.end) {
+                throw std::logic_error("restore requires a book that has not handed out order IDs");
+            }
+        }
+        SnapshotHeader header{};
+        if (std::fread(&header, sizeof(header), 1, file) != 1
+            || std::memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0
+            || header.version != snapshot_version) {
+            throw std::runtime_error("not a compatible book snapshot: " + path);
+        }
+
+        std::vector<Order> orders;
+        for (uint32_t t = 0; t < header.ticker_count; t++) {
+            SnapshotTickerHeader ticker_header{};
+            if (std::fread(&ticker_header, sizeof(ticker_header), 1, file) != 1) {
+                throw std::runtime_error("truncated book snapshot: " + path);
+            }
+            int index = slot_for(ticker_header.ticker);
+            Book& book = book_at(index);
+            size_t total = static_cast<size_t>(ticker_header.buy_count) + ticker_header.sell_count;
+            orders.resize(total);
+            if (std::fread(orders.data(), sizeof(Order), total, file) != total) {
+                throw std::runtime_error("truncated book snapshot: " + path);
+            }
+
+            std::lock_guard<LockPolicy> guard(book.lock);
+            book.pool.reserve(total);
+            auto load = [&](auto& side, Side expected, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    // The price check in append_worst_to_best cannot see an order filed under the wrong side or ticker.
+                    if (orders[i].side != expected || orders[i].ticker != ticker_header.ticker) {
+                        throw std::runtime_error("corrupt book snapshot: " + path);
+                    }
+                    Node* node = side.append_worst_to_best(orders[i]);
+                    if (!node) {
+                        throw std::runtime_error("book snapshot is out of price order: " + path);
+                    }
+                    order_index.publish(orders[i].order_id, index, node);
+                }
+            };
+            load(book.buy_orders, Side::Buy, 0, ticker_header.buy_count);
+            load(book.sell_orders, Side::Sell, ticker_header.buy_count, total);
+            publish_quote(book);
+        }
+
+        order_ids.advance_to(header.next_order_id);
+    }
+
+    /*
+     * Add a burst of orders with amortized locking.
+     * - The batch is grouped by ticker (keeping arrival order within each ticker), and
+     *   each ticker's lock is taken once for its whole group.
+     * - IDs are assigned under each ticker's lock as in add_order; any order_id already
+     *   set in the input is ignored. With order_ids given, order_ids[i] receives the
+     *   ID of orders[i].
+     * - Every fill is appended to fills, grouped by ticker, as well as being reported.
+     * - An out-of-band order (see add_order) throws; orders applied before it stay applied.
+     */
+
+    void add_orders(const Order* orders, size_t count, std::vector<Execution>& fills, uint64_t* order_ids_out = nullptr) {
+        thread_local std::vector<uint32_t> grouped;
+        grouped.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            grouped[i] = static_cast<uint32_t>(i);
+        }
+        // Ties broken on position keep arrival order without stable_sort's temporary buffer.
+        std::sort(grouped.begin(), grouped.end(), [orders](uint32_t a, uint32_t b) {
+            return orders[a].ticker < orders[b].ticker || (orders[a].ticker == orders[b].ticker && a < b);
+        });
+
+        size_t pos = 0;
+        while (pos < count) {
+            int32_t ticker = orders[grouped[pos]].ticker;
+            int index = slot_for(ticker);
+            Book& book = book_at(index);
+            TickerLockGuard guard(book);
+            join_auction(book, ticker);
+            for (; pos < count && orders[grouped[pos]].ticker == ticker; pos++) {
+                Order order = orders[grouped[pos]];
+                if (order.type == OrderType::Limit && !in_band(book, order.side, order.price)) {
+                    // Orders already applied stay applied; keep their quote current.
+                    publish_quote(book);
+                    require_in_band(book, order.side, order.price);
+                }
+                order.order_id = order_ids.take(book.ids);
+                if (order_ids_out) {
+                    order_ids_out[grouped[pos]] = order.order_id;
+                }
+                log_order(OrderLogType::Add, order);
+                execute_and_rest(order, book, index, &fills);
+            }
+            publish_quote(book);
+        }
+    }
+
+    void add_orders(const std::vector<Order>& orders, std::vector<Execution>& fills, uint64_t* order_ids_out = nullptr) {
+        add_orders(orders.data(), orders.size(), fills, order_ids_out);
+    }
+
+    /*
+     * Cancel a resting order by ID.
+     * Returns false if the order is unknown or no longer resting (filled or already cancelled).
+     */
+
+    bool cancel_order(uint64_t order_id) {
+        int index = order_index.ticker_of(order_id);
+        if (index < 0) {
+            return false;
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        // The order may have filled between the lookup and taking the lock.
+        Node* node = order_index.node_of(order_id, index);
+        if (!node) {
+            return false;
+        }
+        log_order(OrderLogType::Cancel, node->order);
+        order_index.clear(order_id);
+        on_side(book, node->order.side, [node](auto& side) { side.remove(node); });
+        publish_quote(book);
+        return true;
+    }
+
+    /*
+     * Amend the quantity and/or price of a resting order.
+     * - A quantity decrease at the same price is applied in place and keeps time priority.
+     * - A price change or quantity increase requeues the order at the back of its
+     *   (possibly new) level, and a repriced order is matched first if it now crosses.
+     * - A quantity of zero cancels the order.
+     * Returns false if the order is unknown or no longer resting.
+     */
+
+    bool modify_order(uint64_t order_id, uint32_t quantity, Price price) {
+        if (quantity == 0) {
+            return cancel_order(order_id);
+        }
+        int index = order_index.ticker_of(order_id);
+        if (index < 0) {
+            return false;
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        Node* node = order_index.node_of(order_id, index);
+        if (!node) {
+            return false;
+        }
+        join_auction(book, node->order.ticker);
+        Order order = node->order;
+        order.quantity = quantity;
+        order.price = price;
+        order.type = OrderType::Limit;
+        require_in_band_without(book, order.side, price, node);
+        log_order(OrderLogType::Modify, order);
+        if (price == node->order.price && quantity <= node->order.quantity) {
+            on_side(book, order.side, [node, quantity](auto& side) { side.reduce(node, quantity); });
+            publish_quote(book);
+            return true;
+        }
+        order_index.clear(order_id);
+        on_side(book, order.side, [node](auto& side) { side.remove(node); });
+        execute_and_rest(order, book, index);
+        publish_quote(book);
+        return true;
+    }
+
+    // Convenience overload taking "Buy"/"Sell" and a dollar price.
+    uint64_t add_order(const std::string& order_type, int ticker, int quantity, double price) {
+        return add_order(order_type == "Buy" ? Side::Buy : Side::Sell, ticker, static_cast<uint32_t>(quantity), to_ticks(price));
+    }
+
+    /*
+     * Fills are published to the given reporter; with no reporter they are not reported.
+     * Set it before any orders are added.
+     */
+
+    void set_execution_reporter(ExecutionReporter* execution_reporter) {
+        reporter = execution_reporter;
+    }
+
+    /*
+     * Incremental L2 updates for every ticker are published to the given feed.
+     * Set it before any orders are added (or restored).
+     */
+
+    void set_depth_feed(DepthFeed* feed) {
+        depth_feed = feed;
+        for (size_t index = 0; index < symbols.size(); index++) {
+            if (symbols.ticker_of(index) >= 0) {
+                book_at(index).depth.feed = feed;
+            }
+        }
+    }
+
+    /*
+     * Copy up to max_levels aggregated levels per side, best price first, for one ticker.
+     * Returns the ticker's depth sequence at that instant, so a consumer can apply
+     * only the DepthUpdates that come after it.
+     */
+
+    uint64_t depth_snapshot(int ticker, size_t max_levels, std::vector<PriceLevel>& bids, std::vector<PriceLevel>& asks) {
+        bids.clear();
+        asks.clear();
+        int index = symbols.find(ticker);
+        if (index < 0) {
+            return 0;
+        }
+        Book& book = book_at(index);
+        std::lock_guard<LockPolicy> guard(book.lock);
+        book.buy_orders.for_each_level_best_first(max_levels, [&bids](const PriceLevel& level) { bids.push_back(level); });
+        book.sell_orders.for_each_level_best_first(max_levels, [&asks](const PriceLevel& level) { asks.push_back(level); });
+        return book.depth.sequence;
+    }
+
+    /*
+     * Every add, cancel and modify that changes the book is appended to the given
+     * sink (an OrderLogWriter for replay, or a Journal). Set it before any orders are added.
+     */
+
+    void set_order_log(OrderLogSink* sink) {
+        order_log = sink;
+    }
+
+    /*
+     * Match buy and sell orders for a given ticker.
+     * - The best buy order is executed against the best sell order if the price conditions match.
+     * - Partial fills reduce the head order's quantity in place, so it keeps its time priority.
+     * - An order is only unlinked from its level once it is fully filled.
+     * add_order already matches incoming orders, so this only has work to do when
+     * the book was filled through other means. A ticker in an auction call phase is
+     * left crossed for uncross_auction.
+     */
+
+    void match_order(int ticker) {
+        int index = symbols.find(ticker);
+        if (index < 0) {
+            return;
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        if (book.in_auction) {
+            return;
+        }
+        ThreadMetrics& timings = MetricsRegistry::local();
+        CycleScope timing(timings.sample_timing() ? &timings.match_cycles : nullptr);
+        while (!book.buy_orders.is_empty() && !book.sell_orders.is_empty()) {
+            Order* best_buy = book.buy_orders.peek();
+            Order* best_sell = book.sell_orders.peek();
+            count_metric(book.metrics.match_iterations);
+            
+            if (best_buy->price >= best_sell->price) {
+                uint32_t trade_quantity = std::min(best_buy->quantity, best_sell->quantity);
+                book.buy_orders.fill_best(trade_quantity);
+                book.sell_orders.fill_best(trade_quantity);
+                
+                report_execution(*best_buy, *best_sell, trade_quantity, best_sell->price);
+                count_fill(book, best_buy->quantity > 0 || best_sell->quantity > 0);
+                
+                if (best_buy->quantity == 0) {
+                    order_index.clear(best_buy->order_id);
+                    book.buy_orders.pop();
+                }
+                if (best_sell->quantity == 0) {
+                    order_index.clear(best_sell->order_id);
+                    book.sell_orders.pop();
+                }
+            } else {
+                break;
+            }
+        }
+        publish_quote(book);
+    }
+
+    /*
+     * Current best bid/ask for a ticker, read without taking its lock.
+     * A ticker that never traded has an empty quote.
+     */
+
+    TopOfBook top_of_book(int ticker) const {
+        int index = symbols.find(ticker);
+        return index < 0 ? TopOfBook{} : book_at(index).quote.read();
+    }
+
+    // Replaces quotes with the top of book of every ticker that has a book, in slot order.
+    void top_of_book_all(std::vector<TickerQuote>& quotes) const {
+        quotes.clear();
+        for (size_t index = 0; index < symbols.size(); index++) {
+            int32_t ticker = symbols.ticker_of(index);
+            if (ticker >= 0) {
+                quotes.push_back(TickerQuote{ticker, book_at(index).quote.read()});
+            }
+        }
+    }
+
+    // Appends the metrics of every ticker that has a book.
+    void collect_metrics(std::vector<TickerMetricsSnapshot>& out) const {
+        for (size_t index = 0; index < symbols.size(); index++) {
+            int32_t ticker = symbols.ticker_of(index);
+            if (ticker >= 0) {
+                out.push_back(TickerMetricsSnapshot::of(ticker, book_at(index).metrics));
+            }
+        }
+    }
+
+    // Prints engine totals, thread timings and the top_tickers most contended tickers.
+    void print_metrics(std::ostream& out, size_t top_tickers = 10) const {
+        std::vector<TickerMetricsSnapshot> tickers;
+        collect_metrics(tickers);
+        print_metrics_report(out, tickers, top_tickers);
+    }
+
+    /*
+     * Appends the memory held by every ticker's book, reading each under its lock.
+     * With NullLock, call it from the thread that owns the book.
+     */
+
+    void collect_memory(std::vector<TickerMemory>& out) {
+        for (size_t index = 0; index < symbols.size(); index++) {
+            int32_t ticker = symbols.ticker_of(index);
+            if (ticker < 0) {
+                continue;
+            }
+            Book& book = book_at(index);
+            TickerLockGuard guard(book);
+            out.push_back(TickerMemory{ticker, book.pool.live_nodes(), book.pool.node_capacity(), book.pool.bytes(),
+                                       book.buy_orders.memory_bytes() + book.sell_orders.memory_bytes(), sizeof(Book)});
+        }
+    }
+
+    // Bytes of the structures shared by all tickers: order index, symbol table and book chunk table.
+    size_t shared_bytes() const {
+        return order_index.bytes() + symbols.bytes() + book_chunk_count * sizeof(book_chunks[0]);
+    }
+
+    void print_memory(std::ostream& out, size_t top_tickers = 10) {
+        std::vector<TickerMemory> tickers;
+        collect_memory(tickers);
+        print_memory_report(out, tickers, shared_bytes(), top_tickers);
+    }
+
+    /*
+     * One compaction pass over every ticker, each under its own lock.
+     * - A quiet ticker (no node allocated or released since the previous pass) with at
+     *   least a quarter slab of free nodes has its resting orders moved into one slab
+     *   sized for them (at least nodes_per_ticker), returning the rest to the allocator.
+     *   An empty ladder side also gives back its band arrays.
+     * - An active ticker is only compacted once its pool is over twice what it needs,
+     *   e.g. after a burst, and is then given twice its live count as headroom.
+     * - Either way the orders end up contiguous, best level first, and keep their
+     *   levels, time priority and order IDs; no depth updates are emitted.
+     * A compacted ticker is locked for time proportional to its resting orders.
+     * With NullLock, call it from the thread that owns the book.
+     * Returns the bytes released.
+     */
+
+    size_t compact() {
+        size_t released = 0;
+        for (size_t index = 0; index < symbols.size(); index++) {
+            if (symbols.ticker_of(index) < 0) {
+                continue;
+            }
+            Book& book = book_at(index);
+            TickerLockGuard guard(book);
+            size_t live = book.pool.live_nodes();
+            size_t capacity = book.pool.node_capacity();
+            bool quiet = book.pool.churn_count() == book.compaction_mark;
+            size_t target = std::max(quiet ? live : 2 * live, nodes_per_ticker);
+            bool worthwhile = quiet ? capacity >= target + NodePool::nodes_per_slab() / 4 : capacity > 2 * target;
+            if (worthwhile) {
+                released += compact_book(book, static_cast<int>(index), target);
+            }
+            book.compaction_mark = book.pool.churn_count();
+        }
+        return released;
+    }
+
+    /*
+     * Open a market-wide auction call phase, e.g. for the open or close.
+     * - Every ticker joins it under its own lock before its next order, modify or
+     *   batch is applied, so the switch costs one store however many tickers there are.
+     * - In the call phase Limit orders and modifies rest without matching, leaving the
+     *   book crossed, and IOC, fill-or-kill and market orders are cancelled unfilled.
+     *   Cancels work as usual, and quotes show the crossed best bid/ask.
+     * - Each ticker's entry into the auction is written to the order log as it happens,
+     *   so a replay reproduces it.
+     * Call it from one control thread; it must not overlap uncross_auction.
+     */
+
+    void begin_auction() {
+        auction_call.store(++auction_sessions, std::memory_order_seq_cst);
+    }
+
+    // Put one ticker into a call phase on its own, e.g. a volatility halt.
+    void begin_auction(int32_t ticker) {
+        int index = slot_for(ticker);
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        enter_auction(book, ticker);
+    }
+
+    // Whether a ticker is in an auction call phase (a lazily joined ticker counts once it has joined).
+    bool in_auction(int32_t ticker) {
+        int index = symbols.find(ticker);
+        if (index < 0) {
+            return false;
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        return book.in_auction;
+    }
+
+    /*
+     * Price and volume the ticker would uncross at now, without executing anything.
+     * The result has volume 0 if its book is not crossed.
+     */
+
+    AuctionResult indicative_auction(int32_t ticker) {
+        int index = symbols.find(ticker);
+        if (index < 0) {
+            return AuctionResult{ticker};
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        AuctionResult result = auction_clearing(book);
+        result.ticker = ticker;
+        return result;
+    }
+
+    /*
+     * Uncross one ticker in its call phase and return it to continuous matching.
+     * - The clearing price is the tick, levels or not, that executes the most volume;
+     *   among equal volumes the smallest unmatched surplus wins, then the highest tick for
+     *   a buy surplus, the lowest for a sell surplus, else the midpoint of the tied ticks.
+     * - Every fill trades at that price, best prices first and oldest orders first within
+     *   a level, so what is left never crosses.
+     * A ticker not in a call phase is left alone and returns volume 0.
+     */
+
+    AuctionResult uncross_auction(int32_t ticker, std::vector<Execution>* fills = nullptr) {
+        int index = symbols.find(ticker);
+        if (index < 0) {
+            return AuctionResult{ticker};
+        }
+        Book& book = book_at(index);
+        TickerLockGuard guard(book);
+        return uncross_book(book, ticker, fills);
+    }
+
+    /*
+     * Close the market-wide call phase and uncross every ticker in an auction, in
+     * parallel over pool's workers. Tickers are independent, so each one only takes
+     * its own lock, and order flow may continue:
+     * - a ticker keeps resting orders unmatched until its turn, then trades continuously;
+     * - results receives one AuctionResult per uncrossed ticker, in slot order.
+     * Fills go to the execution reporter. With NullLock, quiesce order flow first.
+     * A ticker whose very first order races with this call may stay in its call phase;
+     * in_auction() shows it and uncross_auction(ticker) clears it.
+     */
+
+    void uncross_auction(WorkStealingPool& pool, std::vector<AuctionResult>& results) {
+        auction_call.store(0, std::memory_order_seq_cst);
+        size_t count = symbols.size();
+        std::vector<AuctionResult> by_slot(count);
+        std::unique_ptr<bool[]> uncrossed(new bool[count]());
+        auto uncross_slot = [&](size_t index) {
+            int32_t ticker = symbols.ticker_of(index);
+            if (ticker < 0) {
+                return;
+            }
+            Book& book = book_at(index);
+            TickerLockGuard guard(book);
+            if (book.in_auction) {
+                by_slot[index] = uncross_book(book, ticker, nullptr);
+                uncrossed[index] = true;
+            }
+        };
+        pool.parallel_for(count, uncross_slot);
+        results.clear();
+        for (size_t index = 0; index < count; index++) {
+            if (uncrossed[index]) {
+                results.push_back(by_slot[index]);
+            }
+        }
+    }
+
+private:
+    /*
+     * Holds a ticker lock for a scope. An uncontended acquire costs one try_lock;
+     * a contended one records its spin count and wait cycles in the ticker metrics.
+     */
+    class TickerLockGuard {
+    private:
+        Book& book;
+
+    public:
+        explicit TickerLockGuard(Book& locked_book) : book(locked_book) {
+            if (!metrics_enabled) {
+                book.lock.lock();
+                return;
+            }
+            if (!book.lock.try_lock()) {
+                uint64_t start = read_cycles();
+                uint32_t spins = book.lock.lock_counting_spins();
+                uint64_t waited = read_cycles() - start;
+                metric_add(book.metrics.lock_contended);
+                metric_add(book.metrics.lock_wait_cycles, waited);
+                book.metrics.lock_spins.record(spins);
+                book.metrics.lock_wait.record(waited);
+            }
+            metric_add(book.metrics.lock_acquisitions);
+        }
+
+        ~TickerLockGuard() {
+            book.lock.unlock();
+        }
+
+        TickerLockGuard(const TickerLockGuard&) = delete;
+        TickerLockGuard& operator=(const TickerLockGuard&) = delete;
+    };
+
+    static void count_metric(std::atomic<uint64_t>& counter) {
+        if (metrics_enabled) {
+            metric_add(counter);
+        }
+    }
+
+    static void count_fill(Book& book, bool partial) {
+        count_metric(book.metrics.fills);
+        if (partial) {
+            count_metric(book.metrics.partial_fills);
+        }
+    }
+
+    // Book of a published slot.
+    Book& book_at(size_t index) const {
+        return book_chunks[index >> book_chunk_bits].load(std::memory_order_acquire)[index & (book_chunk_size - 1)];
+    }
+
+    // Slot of a ticker, creating its book on first use.
+    int slot_for(int32_t ticker) {
+        int index = symbols.find(ticker);
+        if (index >= 0) {
+            return index;
+        }
+        return symbols.find_or_insert(ticker, [this, ticker](int32_t slot) {
+            std::atomic<Book*>& chunk = book_chunks[slot >> book_chunk_bits];
+            Book* books = chunk.load(std::memory_order_acquire);
+            if (!books) {
+                Book* fresh = new Book[book_chunk_size];
+                if (chunk.compare_exchange_strong(books, fresh, std::memory_order_acq_rel)) {
+                    books = fresh;
+                } else {
+                    delete[] fresh;
+                }
+            }
+            Book& book = books[slot & (book_chunk_size - 1)];
+            book.pool.reserve(nodes_per_ticker);
+            book.depth.feed = depth_feed;
+            book.depth.ticker = ticker;
+        });
+    }
+
+    // Moves a ticker's resting nodes into a fresh pool of capacity nodes. The caller holds the lock.
+    size_t compact_book(Book& book, int index, size_t capacity) {
+        size_t before = book.pool.bytes() + book.buy_orders.memory_bytes() + book.sell_orders.memory_bytes();
+        NodePool fresh(capacity);
+        auto move = [this, &fresh, index](Node* node) {
+            Node* moved = fresh.allocate(node->order);
+            order_index.publish(node->order.order_id, index, moved);
+            return moved;
+        };
+        book.buy_orders.relocate(move);
+        book.sell_orders.relocate(move);
+        book.pool = std::move(fresh);
+        size_t after = book.pool.bytes() + book.buy_orders.memory_bytes() + book.sell_orders.memory_bytes();
+        return before > after ? before - after : 0;
+    }
+
+    // Writes a ticker's auction transition to the order log. The caller holds the lock.
+    void log_auction(OrderLogType type, int32_t ticker) {
+        if (order_log) {
+            order_log->append(type, Order(Side::Buy, ticker, 0, 0, 0));
+        }
+    }
+
+    void enter_auction(Book& book, int32_t ticker) {
+        if (!book.in_auction) {
+            book.in_auction = true;
+            log_auction(OrderLogType::AuctionOpen, ticker);
+        }
+    }
+
+    // Enters the open market-wide call phase if the ticker has not joined it yet. The caller holds the lock.
+    void join_auction(Book& book, int32_t ticker) {
+        uint64_t call = auction_call.load(std::memory_order_acquire);
+        if (call != 0 && book.auction_joined != call) {
+            book.auction_joined = call;
+            enter_auction(book, ticker);
+        }
+    }
+
+    /*
+     * Clearing price of a crossed book from its level aggregates alone.
+     * - Only levels inside the crossed range [best ask, best bid] can trade. Every tick
+     *   of that range is a candidate: each level price, and each run of empty ticks
+     *   between two adjacent level prices, where demand and supply are constant, so
+     *   the run is scored once.
+     * - One ascending sweep keeps demand (bids at or above the price) and supply (asks
+     *   at or below it), so the cost is O(crossed levels) however wide the range is.
+     * - Demand minus supply never rises with the price, which is what makes the
+     *   surplus tie-breaks in uncross_auction pick the ends or the midpoint of the tied ticks.
+     * The caller holds the ticker lock.
+     */
+
+    static AuctionResult auction_clearing(Book& book) {
+        struct LevelQuantity {
+            Price price;
+            uint64_t quantity;
+        };
+        AuctionResult result{};
+        if (book.buy_orders.is_empty() || book.sell_orders.is_empty()
+            || book.buy_orders.best_level().price < book.sell_orders.best_level().price) {
+            return result;
+        }
+        thread_local std::vector<LevelQuantity> bids, asks;
+        bids.clear();
+        asks.clear();
+        uint64_t demand = 0, supply = 0;
+        // Bids are collected best (highest) first, asks best (lowest) first.
+        book.buy_orders.for_each_crossing_level(book.sell_orders.best_level().price, [&](const PriceLevel& level) {
+            bids.push_back(LevelQuantity{level.price, level.quantity});
+            demand += level.quantity;
+        });
+        book.sell_orders.for_each_crossing_level(book.buy_orders.best_level().price, [&](const PriceLevel& level) {
+            asks.push_back(LevelQuantity{level.price, level.quantity});
+        });
+
+        size_t bid = bids.size(), ask = 0;
+        uint64_t best_volume = 0, best_surplus = 0;
+        Price low = 0, high = 0;
+        int64_t low_imbalance = 0, high_imbalance = 0;
+        // Scores the ticks [first, last], which all share the current demand and supply.
+        auto consider = [&](Price first, Price last) {
+            uint64_t volume = std::min(demand, supply);
+            int64_t imbalance = static_cast<int64_t>(demand) - static_cast<int64_t>(supply);
+            uint64_t surplus = imbalance < 0 ? -static_cast<uint64_t>(imbalance) : static_cast<uint64_t>(imbalance);
+            if (volume > best_volume || (volume == best_volume && surplus < best_surplus)) {
+                best_volume = volume;
+                best_surplus = surplus;
+                low = first;
+                high = last;
+                low_imbalance = high_imbalance = imbalance;
+            } else if (volume == best_volume && surplus == best_surplus) {
+                high = last;
+                high_imbalance = imbalance;
+            }
+        };
+        bool swept = false;
+        Price previous = 0;
+        while (bid > 0 || ask < asks.size()) {
+            Price price = std::min(bid > 0 ? bids[bid - 1].price : std::numeric_limits<Price>::max(),
+                                   ask < asks.size() ? asks[ask].price : std::numeric_limits<Price>::max());
+            // Empty ticks since the previous level: demand is already down to bids at or above price.
+            if (swept && price - previous > 1) {
+                consider(previous + 1, price - 1);
+            }
+            while (ask < asks.size() && asks[ask].price <= price) {
+                supply += asks[ask++].quantity;
+            }
+            consider(price, price);
+            // Bids at this price no longer count as demand above it.
+            while (bid > 0 && bids[bid - 1].price <= price) {
+                demand -= bids[--bid].quantity;
+            }
+            swept = true;
+            previous = price;
+        }
+
+        if (high_imbalance > 0) {
+            result.price = high;
+        } else if (low_imbalance < 0) {
+            result.price = low;
+        } else {
+            result.price = low + (high - low) / 2;
+        }
+        demand = supply = 0;
+        for (const LevelQuantity& level : bids) {
+            demand += level.price >= result.price ? level.quantity : 0;
+        }
+        for (const LevelQuantity& level : asks) {
+            supply += level.price <= result.price ? level.quantity : 0;
+        }
+        result.volume = best_volume;
+        result.imbalance = static_cast<int64_t>(demand) - static_cast<int64_t>(supply);
+        return result;
+    }
+
+    // Executes a ticker's uncross at its clearing price and leaves its call phase. The caller holds the lock.
+    AuctionResult uncross_book(Book& book, int32_t ticker, std::vector<Execution>* fills) {
+        if (!book.in_auction) {
+            return AuctionResult{ticker};
+        }
+        log_auction(OrderLogType::AuctionUncross, ticker);
+        AuctionResult result = auction_clearing(book);
+        result.ticker = ticker;
+        while (result.volume > 0 && !book.buy_orders.is_empty() && !book.sell_orders.is_empty()) {
+            Order* buy = book.buy_orders.peek();
+            Order* sell = book.sell_orders.peek();
+            if (buy->price < result.price || sell->price > result.price) {
+                break;
+            }
+            count_metric(book.metrics.match_iterations);
+            uint32_t trade_quantity = std::min(buy->quantity, sell->quantity);
+            book.buy_orders.fill_best(trade_quantity);
+            book.sell_orders.fill_best(trade_quantity);
+            report_execution(*buy, *sell, trade_quantity, result.price, fills);
+            count_fill(book, buy->quantity > 0 || sell->quantity > 0);
+            if (buy->quantity == 0) {
+                order_index.clear(buy->order_id);
+                book.buy_orders.pop();
+            }
+            if (sell->quantity == 0) {
+                order_index.clear(sell->order_id);
+                book.sell_orders.pop();
+            }
+        }
+        book.in_auction = false;
+        // A ticker uncrossed on its own does not rejoin the market-wide call phase.
+        book.auction_joined = auction_call.load(std::memory_order_relaxed);
+        publish_quote(book);
+        return result;
+    }
+
+    static bool in_band(Book& book, Side side, Price price) {
+        return side == Side::Buy ? book.buy_orders.in_band(price) : book.sell_orders.in_band(price);
+    }
+
+    // Rejects, before anything is logged or matched, an order whose side could not rest it.
+    static void require_in_band(Book& book, Side side, Price price) {
+        if (!in_band(book, side, price)) {
+            throw std::out_of_range("price outside the ticker's ladder band");
+        }
+    }
+
+    // require_in_band for a resting node being repriced, judged as if it were already removed.
+    static void require_in_band_without(Book& book, Side side, Price price, const Node* node) {
+        bool fits = side == Side::Buy ? book.buy_orders.in_band_without(price, node)
+                                      : book.sell_orders.in_band_without(price, node);
+        if (!fits) {
+            throw std::out_of_range("price outside the ticker's ladder band");
+        }
+    }
+
+    // Runs f on the side of the book an order rests on; each branch calls its own specialization.
+    template <typename Function>
+    static void on_side(Book& book, Side side, Function f) {
+        if (side == Side::Buy) {
+            f(book.buy_orders);
+        } else {
+            f(book.sell_orders);
+        }
+    }
+
+    /*
+     * Match an incoming order against the opposite side, then rest and index any
+     * unfilled remainder of a Limit order on its own side; other types drop it.
+     * During an auction call phase a Limit order rests unmatched and other types are dropped.
+     * The caller must hold the ticker lock.
+     * The side is checked once here; everything below runs on a per-side instantiation.
+     */
+
+    void execute_and_rest(Order& order, Book& book, int index, std::vector<Execution>* fills = nullptr) {
+        if (order.side == Side::Buy) {
+            execute_and_rest_as<Side::Buy>(order, book, index, fills);
+        } else {
+            execute_and_rest_as<Side::Sell>(order, book, index, fills);
+        }
+    }
+
+    template <Side Aggressor>
+    void execute_and_rest_as(Order& order, Book& book, int index, std::vector<Execution>* fills) {
+        ThreadMetrics& timings = MetricsRegistry::local();
+        bool timed = timings.sample_timing();
+        count_metric(book.metrics.orders_added);
+        if (book.in_auction) {
+            // Call phase: limit orders rest even if they cross; nothing else can wait for the uncross.
+            if (order.type != OrderType::Limit) {
+                count_metric(book.metrics.orders_killed);
+                return;
+            }
+            CycleScope timing(timed ? &timings.insert_cycles : nullptr);
+            Node* node = book.template side<Aggressor>().insert(order);
+            order_index.publish(order.order_id, index, node);
+            return;
+        }
+        if (order.type == OrderType::Market) {
+            // No limit: every opposite level crosses.
+            order.price = Aggressor == Side::Buy ? std::numeric_limits<Price>::max() : std::numeric_limits<Price>::min();
+        } else if (order.type == OrderType::FillOrKill
+                   && book.template side<opposite_side(Aggressor)>().crossing_quantity(order.price, order.quantity)
+                          < order.quantity) {
+            count_metric(book.metrics.orders_killed);
+            return;
+        }
+        {
+            CycleScope timing(timed ? &timings.match_cycles : nullptr);
+            match_incoming<Aggressor>(order, book, fills);
+        }
+        if (order.quantity > 0 && order.type != OrderType::Limit) {
+            count_metric(book.metrics.orders_killed);
+        } else if (order.quantity > 0) {
+            CycleScope timing(timed ? &timings.insert_cycles : nullptr);
+            Node* node = book.template side<Aggressor>().insert(order);
+            order_index.publish(order.order_id, index, node);
+        }
+    }
+
+    // Publishes the ticker's best bid/ask to quote readers. The caller holds the ticker lock.
+    static void publish_quote(Book& book) {
+        Price bid = 0, ask = 0;
+        uint64_t bid_size = 0, ask_size = 0;
+        if (!book.buy_orders.is_empty()) {
+            bid = book.buy_orders.best_level().price;
+            bid_size = book.buy_orders.best_level().quantity;
+        }
+        if (!book.sell_orders.is_empty()) {
+            ask = book.sell_orders.best_level().price;
+            ask_size = book.sell_orders.best_level().quantity;
+        }
+        book.quote.publish(bid, bid_size, ask, ask_size);
+        if (metrics_enabled) {
+            book.metrics.bid_levels.store(book.buy_orders.level_count(), std::memory_order_relaxed);
+            book.metrics.ask_levels.store(book.sell_orders.level_count(), std::memory_order_relaxed);
+        }
+    }
+
+    void log_order(OrderLogType type, const Order& order) {
+        if (order_log) {
+            order_log->append(type, order);
+        }
+    }
+
+    // Logs a fill, publishes it to the reporter and, for batch calls, appends it to the caller's fills.
+    void report_execution(const Order& buy, const Order& sell, uint32_t quantity, Price price,
+                          std::vector<Execution>* fills = nullptr) {
+        Execution execution{buy.order_id, sell.order_id, price, quantity, buy.ticker};
+        if (order_log) {
+            order_log->append_fill(execution);
+        }
+        if (reporter) {
+            reporter->publish(execution);
+        }
+        if (fills) {
+            fills->push_back(execution);
+        }
+    }
+
+    /*
+     * Execute an incoming order against the resting orders of the opposite side.
+     * Trades happen at the resting order's price, best level first and oldest order
+     * first within a level, until the incoming order is filled or no longer crosses.
+     * Instantiated per aggressor side. The caller must hold the ticker lock.
+     */
+
+    template <Side Aggressor>
+    void match_incoming(Order& incoming, Book& book, std::vector<Execution>* fills) {
+        auto& opposite = book.template side<opposite_side(Aggressor)>();
+        while (incoming.quantity > 0 && !opposite.is_empty()) {
+            count_metric(book.metrics.match_iterations);
+            Order* resting = opposite.peek();
+            // No longer crosses once the aggressor's limit would rank ahead of the resting price on that side.
+            if (opposite.better(incoming.price, resting->price)) {
+                break;
+            }
+
+            uint32_t trade_quantity = std::min(incoming.quantity, resting->quantity);
+            incoming.quantity -= trade_quantity;
+            opposite.fill_best(trade_quantity);
+
+            if constexpr (Aggressor == Side::Buy) {
+                report_execution(incoming, *resting, trade_quantity, resting->price, fills);
+            } else {
+                report_execution(*resting, incoming, trade_quantity, resting->price, fills);
+            }
+            count_fill(book, incoming.quantity > 0 || resting->quantity > 0);
+
+            if (resting->quantity == 0) {
+                order_index.clear(resting->order_id);
+                opposite.pop();
+            }
+        }
+    }
+};
+
+// OrderBook backed by dense price ladders, for universes of liquid, tightly banded tickers.
+template <typename LockPolicy = DefaultLockPolicy>
+using LadderOrderBook = OrderBook<LockPolicy, PriceLadderBook>;
+
+OrderBook<> order_book;
+
+/*
+ * NumaTopology lists the CPUs of each NUMA node, read from /sys on Linux.
+ * Machines (or platforms) without that information are treated as one node
+ * holding every CPU.
+ */
+
+class NumaTopology {
+private:
+    std::vector<std::vector<int>> node_cpus;
+
+    // Parses a kernel CPU/node list such as "0-3,8,10-11".
+    static std::vector<int> parse_list(const std::string& list) {
+        std::vector<int> values;
+        size_t start = 0;
+        while (start < list.size()) {
+            size_t end = list.find(',', start);
+            if (end == std::string::npos) {
+                end = list.size();
+            }
+            std::string range = list.substr(start, end - start);
+            size_t dash = range.find('-');
+            if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int value = first; value <= last; value++) {
+                    values.push_back(value);
+                }
+            }
+            start = end + 1;
+        }
+        return values;
+    }
+
+    static bool read_line(const std::string& path, std::string& line) {
+        FILE* file = std::fopen(path.c_str(), "r");
+        if (!file) {
+            return false;
+        }
+        char buffer[4096];
+        bool ok = std::fgets(buffer, sizeof(buffer), file) != nullptr;
+        std::fclose(file);
+        if (ok) {
+            line = buffer;
+            while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) {
+                line.pop_back();
+            }
+        }
+        return ok;
+    }
+
+public:
+    static NumaTopology discover() {
+        NumaTopology topology;
+        std::string line;
+        if (read_line("/sys/devices/system/node/online", line)) {
+            for (int node : parse_list(line)) {
+                std::string cpus;
+                if (read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", cpus)) {
+                    if (topology.node_cpus.size() <= static_cast<size_t>(node)) {
+                        topology.node_cpus.resize(node + 1);
+                    }
+                    topology.node_cpus[node] = parse_list(cpus);
+                }
+            }
+        }
+        if (topology.node_cpus.empty()) {
+            unsigned cpu_count = std::max(1u, std::thread::hardware_concurrency());
+            topology.node_cpus.resize(1);
+            for (unsigned cpu = 0; cpu < cpu_count; cpu++) {
+                topology.node_cpus[0].push_back(static_cast<int>(cpu));
+            }
+        }
+        return topology;
+    }
+
+    size_t node_count() const {
+        return node_cpus.size();
+    }
+
+    // CPUs of a node; empty for memory-only or offline nodes.
+    const std::vector<int>& cpus_of(size_t node) const {
+        return node_cpus[node];
+    }
+
+    // Node owning a CPU, or -1 if the CPU is unknown.
+    int node_of_cpu(int cpu) const {
+        for (size_t node = 0; node < node_cpus.size(); node++) {
+            if (std::find(node_cpus[node].begin(), node_cpus[node].end(), cpu) != node_cpus[node].end()) {
+                return static_cast<int>(node);
+            }
+        }
+        return -1;
+    }
+
+    /*
+     * One CPU per shard, dealing shards round-robin across the nodes that have CPUs
+     * so each node gets an equal share of shards and no CPU is used twice while
+     * free ones remain.
+     */
+    std::vector<int> spread(int shard_count) const {
+        std::vector<int> cpus;
+        bool has_cpus = false;
+        for (const std::vector<int>& list : node_cpus) {
+            has_cpus = has_cpus || !list.empty();
+        }
+        std::vector<size_t> used(node_cpus.size(), 0);
+        for (size_t node = 0; has_cpus && static_cast<int>(cpus.size()) < shard_count; node = (node + 1) % node_cpus.size()) {
+            const std::vector<int>& list = node_cpus[node];
+            if (!list.empty()) {
+                cpus.push_back(list[used[node]++ % list.size()]);
+            }
+        }
+        return cpus;
+    }
+
+    // NUMA node the page holding address currently lives on, or -1 if unknown.
+    static int memory_node_of(const void* address) {
+#if defined(__linux__) && defined(SYS_move_pages)
+        long page_size = sysconf(_SC_PAGESIZE);
+        void* page = reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(address) & ~static_cast<uintptr_t>(page_size - 1));
+        int status = -1;
+        // With no target nodes, move_pages only reports where each page is.
+        if (syscall(SYS_move_pages, 0, 1UL, &page, nullptr, &status, 0) == 0 && status >= 0) {
+            return status;
+        }
+#else
+        (void)address;
+#endif
+        return -1;
+    }
+};
+
+/*
+ * ShardedEngine partitions the ticker space across pinned matching threads.
+ * - Every ticker maps to exactly one shard, which owns its book exclusively, so
+ *   shard books run with NullLock.
+ * - Producers submit orders through each shard's lock-free MPSC inbox; the shard
+ *   thread drains it in batches and matches in arrival order.
+ * - add_order_async attaches a completion to an order: a callback run on the shard
+ *   thread with its OrderAck, or a std::future of it, so one producer can keep many
+ *   orders in flight.
+ * - An order the shard's book refuses (full symbol table, out-of-band price) is
+ *   counted in rejected() and, with a completion, acked as Rejected; the shard keeps running.
+ * - An order's ID is its shard index in the top 8 bits and its inbox position below.
+ *   The producer knows it as soon as the push lands, the shard rebuilds it as it
+ *   drains the inbox in position order, and so IDs increase in the order every shard,
+ *   and therefore every ticker, applies them, with no shared counter.
+ * - Shard count, CPU pinning and the ticker-to-shard map are configurable.
+ * - A pinned shard is built on a thread already running on its CPU, and its books,
+ *   node slabs and index chunks are later allocated by its pinned worker, so the
+ *   kernel's first-touch policy places all of its memory on that CPU's NUMA node.
+ */
+
+class ShardedEngine {
+public:
+    struct Config {
+        int shard_count = 4;
+        // cpus[i] is the CPU shard i is pinned to; empty leaves shards unpinned unless numa_spread is set.
+        std::vector<int> cpus;
+        // With no cpus given, pin shards round-robin across the NUMA nodes.
+        bool numa_spread = false;
+        // shard_map[ticker] is the owning shard for tickers below its size; others go to ticker % shard_count.
+        std::vector<int> shard_map;
+        size_t queue_capacity = 1 << 16;
+        size_t nodes_per_ticker = 0;
+        // Distinct tickers each shard can hold.
+        size_t max_symbols_per_shard = OrderBook<NullLock>::default_max_symbols;
+    };
+
+private:
+    static constexpr size_t batch_size = 256;
+
+    // One inbox entry; orders submitted without a callback skip building an ack.
+    struct Request {
+        Order order;
+        AckCallback callback;
+        void* context;
+    };
+
+    static constexpr int shard_id_shift = 56;
+    static constexpr int max_shards = 1 << (64 - shard_id_shift);
+
+    struct alignas(64) Shard {
+        OrderBook<NullLock> book;
+        MpscRing<Request> inbox;
+        std::thread worker;
+        uint64_t id_prefix;
+        // Inbox position of the next request to drain; shard thread only.
+        uint64_t drained = 0;
+        // Written by the shard thread only.
+        std::atomic<uint64_t> rejected{0};
+
+        Shard(size_t nodes_per_ticker, size_t max_symbols, size_t queue_capacity, uint64_t prefix)
+            : book(nodes_per_ticker, max_symbols), inbox(queue_capacity), id_prefix(prefix) {}
+    };
+
+    Config config;
+    NumaTopology topology;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<int> shard_of_ticker;
+    std::atomic<bool> running;
+
+    // Pins the calling thread, so everything it allocates afterwards is first touched on that CPU's node.
+    static void pin_current_thread(int cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+        (void)cpu;
+#endif
+    }
+
+    int cpu_of_shard(size_t shard) const {
+        return shard < config.cpus.size() ? config.cpus[shard] : -1;
+    }
+
+    // Constructs a shard on a thread pinned to its CPU so its memory starts out node-local.
+    Shard* build_shard(int index, int cpu) {
+        uint64_t prefix = static_cast<uint64_t>(index) << shard_id_shift;
+        if (cpu < 0) {
+            return new Shard(config.nodes_per_ticker, config.max_symbols_per_shard, config.queue_capacity, prefix);
+        }
+        Shard* shard = nullptr;
+        std::exception_ptr error;
+        std::thread builder([this, prefix, cpu, &shard, &error]() {
+            pin_current_thread(cpu);
+            try {
+                shard = new Shard(config.nodes_per_ticker, config.max_symbols_per_shard, config.queue_capacity, prefix);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        });
+        builder.join();
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return shard;
+    }
+
+    void run_shard(Shard& shard, int cpu) {
+        if (cpu >= 0) {
+            pin_current_thread(cpu);
+        }
+        std::vector<Request> batch(batch_size);
+        OrderAck ack;
+        unsigned idle_rounds = 0;
+        for (;;) {
+            // Read the flag before draining: an empty drain after stop() means the inbox is clear.
+            bool stopping = !running.load(std::memory_order_acquire);
+            size_t count = shard.inbox.pop_batch(batch.data(), batch_size);
+            if (count > 0) {
+                for (size_t i = 0; i < count; i++) {
+                    batch[i].order.order_id = shard.id_prefix | shard.drained++;
+                    if (batch[i].callback) {
+                        complete(shard, batch[i], ack);
+                    } else {
+                        try {
+                            shard.book.add_order(batch[i].order);
+                        } catch (const std::exception&) {
+                            shard.rejected.fetch_add(1, std::memory_order_relaxed);
+                        }
+                    }
+                }
+                idle_rounds = 0;
+            } else if (stopping) {
+                break;
+            } else if (++idle_rounds < 1024) {
+                cpu_relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    // Matches a request with a completion and hands its ack to the callback.
+    static void complete(Shard& shard, const Request& request, OrderAck& ack) {
+        try {
+            shard.book.submit_order(request.order, ack);
+        } catch (const std::exception& e) {
+            ack.order_id = request.order.order_id;
+            ack.ticker = request.order.ticker;
+            ack.status = OrderStatus::Rejected;
+            ack.filled_quantity = 0;
+            ack.resting_quantity = 0;
+            ack.fills.clear();
+            ack.reason = e.what();
+            shard.rejected.fetch_add(1, std::memory_order_relaxed);
+        }
+        request.callback(ack, request.context);
+    }
+
+    uint64_t enqueue(Side side, int32_t ticker, uint32_t quantity, Price price, OrderType type, AckCallback callback,
+                     void* context) {
+        if (ticker < 0) {
+            throw std::invalid_argument("ticker must be non-negative");
+        }
+        // The shard fills in the ID from the inbox position.
+        Request request{Order(side, ticker, quantity, price, 0, type), callback, context};
+        size_t mapped = static_cast<size_t>(ticker);
+        Shard& shard = *shards[mapped < shard_of_ticker.size() ? shard_of_ticker[mapped] : ticker % config.shard_count];
+        size_t position;
+        while (!shard.inbox.try_push(request, position)) {
+            std::this_thread::yield();
+        }
+        return shard.id_prefix | position;
+    }
+
+public:
+    explicit ShardedEngine(const Config& engine_config)
+        : config(engine_config), topology(NumaTopology::discover()), shard_of_ticker(engine_config.shard_map),
+          running(false) {
+        if (config.shard_count < 1 || config.shard_count > max_shards) {
+            throw std::invalid_argument("shard_count must be between 1 and 256");
+        }
+        for (int shard : shard_of_ticker) {
+            if (shard < 0 || shard >= config.shard_count) {
+                throw std::invalid_argument("shard_map entry out of range");
+            }
+        }
+        if (config.cpus.empty() && config.numa_spread) {
+            config.cpus = topology.spread(config.shard_count);
+        }
+        for (int i = 0; i < config.shard_count; i++) {
+            shards.emplace_back(build_shard(i, cpu_of_shard(i)));
+        }
+    }
+
+    ~ShardedEngine() {
+        stop();
+    }
+
+    void set_execution_reporter(ExecutionReporter* reporter) {
+        for (auto& shard : shards) {
+            shard->book.set_execution_reporter(reporter);
+        }
+    }
+
+    void set_order_log(OrderLogSink* sink) {
+        for (auto& shard : shards) {
+            shard->book.set_order_log(sink);
+        }
+    }
+
+    // A ticker lives on exactly one shard, so its depth sequence stays contiguous.
+    void set_depth_feed(DepthFeed* feed) {
+        for (auto& shard : shards) {
+            shard->book.set_depth_feed(feed);
+        }
+    }
+
+    void start() {
+        running.store(true, std::memory_order_release);
+        for (size_t i = 0; i < shards.size(); i++) {
+            Shard& shard = *shards[i];
+            shard.worker = std::thread(&ShardedEngine::run_shard, this, std::ref(shard), cpu_of_shard(i));
+        }
+    }
+
+    /*
+     * Describe where each shard runs and where its memory actually is.
+     * The memory node is queried from the kernel for the shard's own pages;
+     * "?" means the platform cannot report it.
+     */
+
+    void print_placement(std::ostream& out) const {
+        out << "NUMA nodes: " << topology.node_count() << "\n";
+        for (size_t i = 0; i < shards.size(); i++) {
+            int cpu = cpu_of_shard(i);
+            int memory_node = NumaTopology::memory_node_of(shards[i].get());
+            out << "shard " << i << ": ";
+            if (cpu < 0) {
+                out << "unpinned";
+            } else {
+                out << "cpu " << cpu << " (node " << topology.node_of_cpu(cpu) << ")";
+            }
+            out << ", memory on node ";
+            if (memory_node < 0) {
+                out << "?";
+            } else {
+                out << memory_node;
+            }
+            out << "\n";
+        }
+    }
+
+    // Metrics of every shard's tickers; see OrderBook::print_metrics.
+    void print_metrics(std::ostream& out, size_t top_tickers = 10) const {
+        std::vector<TickerMetricsSnapshot> tickers;
+        for (const auto& shard : shards) {
+            shard->book.collect_metrics(tickers);
+        }
+        print_metrics_report(out, tickers, top_tickers);
+    }
+
+    // Drains every submitted order, then joins the shard threads.
+    void stop() {
+        running.store(false, std::memory_order_release);
+        for (auto& shard : shards) {
+            if (shard->worker.joinable()) {
+                shard->worker.join();
+            }
+        }
+    }
+
+    /*
+     * Submit an order to the shard owning its ticker. Matching happens
+     * asynchronously on that shard's thread. Returns the assigned order ID.
+     */
+
+    uint64_t add_order(Side side, int32_t ticker, uint32_t quantity, Price price, OrderType type = OrderType::Limit) {
+        return enqueue(side, ticker, quantity, price, type, nullptr, nullptr);
+    }
+
+    /*
+     * Submit an order and have callback(ack, context) run on the owning shard's
+     * thread once it has been matched. The callback holds up that shard's matching
+     * and must not block; the ack is only valid during the call.
+     * Returns the assigned order ID.
+     */
+
+    uint64_t add_order_async(Side side, int32_t ticker, uint32_t quantity, Price price, OrderType type,
+                             AckCallback callback, void* context) {
+        if (!callback) {
+            throw std::invalid_argument("callback must not be null");
+        }
+        return enqueue(side, ticker, quantity, price, type, callback, context);
+    }
+
+    // Submit an order and get its OrderAck through a future, fulfilled on the shard thread.
+    std::future<OrderAck> add_order_async(Side side, int32_t ticker, uint32_t quantity, Price price,
+                                          OrderType type = OrderType::Limit) {
+        std::unique_ptr<std::promise<OrderAck>> promise(new std::promise<OrderAck>());
+        std::future<OrderAck> result = promise->get_future();
+        AckCallback fulfil = [](const OrderAck& ack, void* context) {
+            std::unique_ptr<std::promise<OrderAck>> owned(static_cast<std::promise<OrderAck>*>(context));
+            owned->set_value(ack);
+        };
+        enqueue(side, ticker, quantity, price, type, fulfil, promise.get());
+        promise.release();
+        return result;
+    }
+
+    // Orders the shard books rejected, with or without a completion.
+    uint64_t rejected() const {
+        uint64_t total = 0;
+        for (const auto& shard : shards) {
+            total += shard->rejected.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+/*
+ * CombiningEngine replaces the per-ticker spinlocks with flat combining.
+ * - Tickers are spread over combining shards. Each shard has a bounded lock-free
+ *   MPSC ring and a combiner flag.
+ * - add_order pushes the order into its shard's ring, then waits until it has been
+ *   applied. A waiting producer that finds the flag free becomes the combiner and
+ *   applies queued orders from every producer in ring order, up to combine_limit
+ *   per turn. Every order is applied by some waiting producer, so none is stranded.
+ * - Only the combiner touches a shard's tickers, so all shards share one
+ *   OrderBook<NullLock>. A hot ticker's book stays in the combining core's cache
+ *   instead of bouncing between every producer fighting for its lock.
+ * - The combiner assigns each order its ID from the ticker's reserved block (see
+ *   OrderBook::add_order) and hands it, or the book's exception, back to the
+ *   waiting producer.
+ * add_order returns once the order is matched, as with OrderBook::add_order.
+ */
+
+class CombiningEngine {
+public:
+    struct Config {
+        int shard_count = 64;
+        size_t queue_capacity = 1024;
+        size_t nodes_per_ticker = 0;
+        size_t max_symbols = OrderBook<NullLock>::default_max_symbols;
+    };
+
+private:
+    static constexpr size_t batch_size = 64;
+    static constexpr size_t combine_limit = 4096;
+
+    // An order plus where its waiting producer wants the outcome written.
+    struct Request {
+        Order order;
+        uint64_t* order_id;
+        std::exception_ptr* error;
+    };
+
+    struct alignas(64) Shard {
+        MpscRing<Request> inbox;
+        alignas(64) std::atomic<bool> combining;
+        // Orders popped and applied so far; an order at ring position p is done once applied > p.
+        alignas(64) std::atomic<size_t> applied;
+
+        explicit Shard(size_t queue_capacity) : inbox(queue_capacity), combining(false), applied(0) {}
+    };
+
+    Config config;
+    OrderBook<NullLock> book;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::atomic<uint64_t> rejected_orders;
+
+    // Applies queued orders if no other thread is combining. Returns false if one was.
+    bool try_combine(Shard& shard) {
+        if (shard.combining.load(std::memory_order_relaxed)
+            || shard.combining.exchange(true, std::memory_order_acquire)) {
+            return false;
+        }
+        Request batch[batch_size];
+        size_t done = shard.applied.load(std::memory_order_relaxed);
+        for (size_t turn = 0; turn < combine_limit;) {
+            size_t count = shard.inbox.pop_batch(batch, batch_size);
+            if (count == 0) {
+                break;
+            }
+            for (size_t i = 0; i < count; i++) {
+                const Order& order = batch[i].order;
+                try {
+                    *batch[i].order_id = book.add_order(order.side, order.ticker, order.quantity, order.price, order.type);
+                } catch (...) {
+                    *batch[i].error = std::current_exception();
+                    rejected_orders.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            done += count;
+            turn += count;
+            shard.applied.store(done, std::memory_order_release);
+        }
+        shard.combining.store(false, std::memory_order_release);
+        return true;
+    }
+
+public:
+    CombiningEngine() : CombiningEngine(Config()) {}
+
+    explicit CombiningEngine(const Config& engine_config)
+        : config(engine_config), book(engine_config.nodes_per_ticker, engine_config.max_symbols),
+          rejected_orders(0) {
+        if (config.shard_count < 1) {
+            throw std::invalid_argument("shard_count must be at least 1");
+        }
+        for (int i = 0; i < config.shard_count; i++) {
+            shards.emplace_back(new Shard(config.queue_capacity));
+        }
+    }
+
+    CombiningEngine(const CombiningEngine&) = delete;
+    CombiningEngine& operator=(const CombiningEngine&) = delete;
+
+    void set_execution_reporter(ExecutionReporter* reporter) {
+        book.set_execution_reporter(reporter);
+    }
+
+    void set_order_log(OrderLogSink* sink) {
+        book.set_order_log(sink);
+    }
+
+    void set_depth_feed(DepthFeed* feed) {
+        book.set_depth_feed(feed);
+    }
+
+    /*
+     * Submit an order and return once it has been matched, by this thread or by
+     * whichever producer was combining its shard. Returns the assigned order ID;
+     * an order the book rejects rethrows the book's exception here.
+     */
+
+    uint64_t add_order(Side side, int32_t ticker, uint32_t quantity, Price price, OrderType type = OrderType::Limit) {
+        if (ticker < 0) {
+            throw std::invalid_argument("ticker must be non-negative");
+        }
+        uint64_t order_id = 0;
+        std::exception_ptr error;
+        Request request{Order(side, ticker, quantity, price, 0, type), &order_id, &error};
+        Shard& shard = *shards[ticker % config.shard_count];
+        size_t position;
+        while (!shard.inbox.try_push(request, position)) {
+            // Full ring: help drain it rather than wait on the combiner.
+            if (!try_combine(shard)) {
+                cpu_relax();
+            }
+        }
+        unsigned idle_rounds = 0;
+        while (shard.applied.load(std::memory_order_acquire) <= position) {
+            if (try_combine(shard)) {
+                idle_rounds = 0;
+            } else if (++idle_rounds < 1024) {
+                cpu_relax();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return order_id;
+    }
+
+    // Lock-free read of the ticker's best bid/ask; see OrderBook::top_of_book.
+    TopOfBook top_of_book(int32_t ticker) const {
+        return book.top_of_book(ticker);
+    }
+
+    // Orders the book rejected.
+    uint64_t rejected() const {
+        return rejected_orders.load(std::memory_order_relaxed);
+    }
+
+    void print_metrics(std::ostream& out, size_t top_tickers = 10) const {
+        book.print_metrics(out, top_tickers);
+    }
+};
+
+#ifdef STOCK_ENGINE_HAS_RECVMMSG
+/*
+ * Gateway wire protocol: UDP datagrams in native byte order, like the order log.
+ * - A datagram is a GatewayHeader followed by count orders laid out exactly as
+ *   Order, so the gateway hands the receive buffer to OrderBook::add_orders in
+ *   place. Their order_id fields are ignored; the engine assigns IDs.
+ * - sequence numbers the datagram's first order within its session; each session
+ *   numbers its orders from 0 without gaps.
+ * - The gateway answers every session it heard from in a receive batch with a
+ *   GatewayAck: the next sequence it expects (which also asks for a resend after
+ *   a loss) and how many orders beyond it the client may have in flight.
+ */
+
+struct GatewayHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t count;
+    uint32_t session;
+    uint32_t reserved;
+    uint64_t sequence;
+};
+
+struct GatewayAck {
+    uint32_t magic;
+    uint32_t session;
+    uint64_t next_sequence;
+    uint64_t window;
+    // Batches of this session's orders the book refused so far.
+    uint64_t rejected_batches;
+};
+
+constexpr uint32_t gateway_magic = 0x4f455453;
+constexpr uint16_t gateway_version = 1;
+// The UDP payload of one unfragmented Ethernet frame.
+constexpr size_t gateway_max_datagram = 1472;
+constexpr size_t gateway_max_orders = (gateway_max_datagram - sizeof(GatewayHeader)) / sizeof(Order);
+
+static_assert(sizeof(GatewayHeader) == 24 && sizeof(GatewayHeader) % alignof(Order) == 0,
+              "GatewayHeader layout is part of the wire format");
+static_assert(sizeof(GatewayAck) == 32, "GatewayAck layout is part of the wire format");
+static_assert(sizeof(Order) == 32 && offsetof(Order, price) == 8 && offsetof(Order, quantity) == 16
+                  && offsetof(Order, ticker) == 20 && offsetof(Order, side) == 24 && offsetof(Order, type) == 25,
+              "Order layout is part of the gateway wire format");
+
+/*
+ * OrderGateway receives the wire protocol on a UDP socket and feeds it to a book.
+ * - One thread drains the socket with recvmmsg, up to batch_datagrams per call,
+ *   into 64-byte-aligned buffers, and applies each datagram's orders with one
+ *   add_orders call straight from the buffer.
+ * - A datagram is applied only if it starts at its session's next sequence.
+ *   Duplicates and datagrams after a gap are dropped and counted, and the ack
+ *   tells the client where to resume. Acks go to the address of the session's
+ *   last accepted datagram.
+ * - Backpressure is credit based: matching runs on the receive thread, so acks,
+ *   and with them the client's window, only advance as fast as the book applies
+ *   orders. Beyond that the kernel's receive buffer absorbs bursts and drops.
+ *   The window is enforced here too: a datagram reaching past the last acked
+ *   sequence plus window is dropped and counted, and the ack asks for it again.
+ * - Orders with an invalid side, type, ticker or quantity are skipped, and a batch
+ *   the book throws on is counted against its session (see add_orders).
+ * Linux only.
+ */
+
+template <typename Book>
+class OrderGateway {
+public:
+    struct Config {
+        // 0 binds an ephemeral port; see port().
+        uint16_t port = 0;
+        bool loopback_only = false;
+        size_t batch_datagrams = 64;
+        // Session ids must be below this.
+        size_t max_sessions = 1024;
+        // Orders a client may send beyond the last acknowledged sequence.
+        uint64_t window = 4096;
+        int receive_buffer_bytes = 4 << 20;
+    };
+
+    struct Stats {
+        std::atomic<uint64_t> datagrams{0};
+        std::atomic<uint64_t> orders{0};
+        std::atomic<uint64_t> duplicates{0};
+        std::atomic<uint64_t> gaps{0};
+        std::atomic<uint64_t> over_window{0};
+        std::atomic<uint64_t> malformed{0};
+        std::atomic<uint64_t> invalid_orders{0};
+        std::atomic<uint64_t> rejected_batches{0};
+    };
+
+private:
+    struct alignas(64) Datagram {
+        unsigned char bytes[gateway_max_datagram];
+    };
+
+    struct Session {
+        uint64_t next_sequence = 0;
+        // next_sequence as of the last ack sent; the client may send up to window beyond it.
+        uint64_t acked_sequence = 0;
+        uint64_t rejected_batches = 0;
+        sockaddr_in peer{};
+        bool ack_pending = false;
+    };
+
+    Book& book;
+    Config config;
+    int fd;
+    uint16_t bound_port;
+    std::vector<Session> sessions;
+    std::vector<uint32_t> touched;
+    std::unique_ptr<Datagram[]> buffers;
+    std::vector<mmsghdr> messages;
+    std::vector<iovec> vectors;
+    std::vector<sockaddr_in> peers;
+    std::vector<GatewayAck> acks;
+    std::vector<mmsghdr> ack_messages;
+    std::vector<iovec> ack_vectors;
+    std::vector<Execution> fills;
+    Stats counters;
+    std::atomic<bool> running;
+    std::thread worker;
+
+    static bool valid(const Order& order) {
+        return static_cast<uint8_t>(order.side) <= static_cast<uint8_t>(Side::Sell)
+            && static_cast<uint8_t>(order.type) <= static_cast<uint8_t>(OrderType::Market) && order.ticker >= 0
+            && order.quantity > 0;
+    }
+
+    // Applies consecutive valid orders with one add_orders call each.
+    void apply(const Order* orders, size_t count, Session& session) {
+        size_t start = 0;
+        while (start < count) {
+            size_t end = start;
+            while (end < count && valid(orders[end])) {
+                end++;
+            }
+            if (end > start) {
+                try {
+                    book.add_orders(orders + start, end - start, fills);
+                } catch (const std::exception&) {
+                    session.rejected_batches++;
+                    counters.rejected_batches.fetch_add(1, std::memory_order_relaxed);
+                }
+                fills.clear();
+            }
+            if (end < count) {
+                counters.invalid_orders.fetch_add(1, std::memory_order_relaxed);
+                end++;
+            }
+            start = end;
+        }
+    }
+
+    void handle(const Datagram& datagram, size_t length, const sockaddr_in& peer) {
+        counters.datagrams.fetch_add(1, std::memory_order_relaxed);
+        const GatewayHeader* header = reinterpret_cast<const GatewayHeader*>(datagram.bytes);
+        if (length < sizeof(GatewayHeader) || header->magic != gateway_magic || header->version != gateway_version
+            || header->session >= sessions.size()
+            || length != sizeof(GatewayHeader) + size_t(header->count) * sizeof(Order)) {
+            counters.malformed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Session& session = sessions[header->session];
+        bool in_sequence = header->sequence == session.next_sequence;
+        bool in_window = header->sequence + header->count <= session.acked_sequence + config.window;
+        // Only an accepted datagram (or the session's first) may move where its acks go,
+        // so a stray or replayed datagram cannot redirect them.
+        if ((in_sequence && in_window) || session.peer.sin_family == 0) {
+            session.peer = peer;
+        }
+        if (!session.ack_pending) {
+            session.ack_pending = true;
+            touched.push_back(header->session);
+        }
+        if (!in_sequence) {
+            auto& counter = header->sequence < session.next_sequence ? counters.duplicates : counters.gaps;
+            counter.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (!in_window) {
+            counters.over_window.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        session.next_sequence += header->count;
+        counters.orders.fetch_add(header->count, std::memory_order_relaxed);
+        apply(reinterpret_cast<const Order*>(datagram.bytes + sizeof(GatewayHeader)), header->count, session);
+    }
+
+    // One ack per session heard from in the last receive batch, sent with one sendmmsg.
+    void send_acks() {
+        size_t count = touched.size();
+        for (size_t i = 0; i < count; i++) {
+            Session& session = sessions[touched[i]];
+            session.ack_pending = false;
+            session.acked_sequence = session.next_sequence;
+            acks[i] = GatewayAck{gateway_magic, touched[i], session.next_sequence, config.window,
+                                 session.rejected_batches};
+            ack_vectors[i] = iovec{&acks[i], sizeof(GatewayAck)};
+            ack_messages[i] = mmsghdr{};
+            ack_messages[i].msg_hdr.msg_name = &session.peer;
+            ack_messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            ack_messages[i].msg_hdr.msg_iov = &ack_vectors[i];
+            ack_messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        // A lost ack is recovered by the client's resend, so a full send buffer is not retried.
+        for (size_t sent = 0; sent < count;) {
+            int result = sendmmsg(fd, ack_messages.data() + sent, static_cast<unsigned>(count - sent), MSG_DONTWAIT);
+            if (result <= 0) {
+                break;
+            }
+            sent += static_cast<size_t>(result);
+        }
+        touched.clear();
+    }
+
+    void run() {
+        while (running.load(std::memory_order_acquire)) {
+            pollfd ready{fd, POLLIN, 0};
+            if (poll(&ready, 1, 10) <= 0) {
+                continue;
+            }
+            for (size_t i = 0; i < config.batch_datagrams; i++) {
+                messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            }
+            int received = recvmmsg(fd, messages.data(), static_cast<unsigned>(config.batch_datagrams), MSG_DONTWAIT,
+                                    nullptr);
+            for (int i = 0; i < received; i++) {
+                handle(buffers[i], messages[i].msg_len, peers[i]);
+            }
+            send_acks();
+        }
+    }
+
+public:
+    OrderGateway(Book& target, const Config& gateway_config)
+        : book(target), config(gateway_config), fd(-1), bound_port(0), sessions(gateway_config.max_sessions),
+          buffers(new Datagram[gateway_config.batch_datagrams]), messages(gateway_config.batch_datagrams),
+          vectors(gateway_config.batch_datagrams), peers(gateway_config.batch_datagrams),
+          acks(gateway_config.batch_datagrams), ack_messages(gateway_config.batch_datagrams),
+          ack_vectors(gateway_config.batch_datagrams), running(false) {
+        if (config.batch_datagrams == 0) {
+            throw std::invalid_argument("batch_datagrams must be at least 1");
+        }
+        if (config.window == 0) {
+            throw std::invalid_argument("window must be at least 1");
+        }
+        touched.reserve(config.batch_datagrams);
+        fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("cannot create gateway socket: ") + std::strerror(errno));
+        }
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &config.receive_buffer_bytes, sizeof(config.receive_buffer_bytes));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(config.port);
+        address.sin_addr.s_addr = htonl(config.loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+        socklen_t length = sizeof(address);
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+            || ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::runtime_error(std::string("cannot bind gateway socket: ") + std::strerror(error));
+        }
+        bound_port = ntohs(address.sin_port);
+        for (size_t i = 0; i < config.batch_datagrams; i++) {
+            vectors[i] = iovec{buffers[i].bytes, sizeof(buffers[i].bytes)};
+            messages[i] = mmsghdr{};
+            messages[i].msg_hdr.msg_name = &peers[i];
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    ~OrderGateway() {
+        stop();
+        ::close(fd);
+    }
+
+    OrderGateway(const OrderGateway&) = delete;
+    OrderGateway& operator=(const OrderGateway&) = delete;
+
+    uint16_t port() const {
+        return bound_port;
+    }
+
+    const Stats& stats() const {
+        return counters;
+    }
+
+    void start() {
+        running.store(true, std::memory_order_release);
+        worker = std::thread(&OrderGateway::run, this);
+    }
+
+    // Stops receiving; datagrams still in the socket buffer are not applied.
+    void stop() {
+        running.store(false, std::memory_order_release);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+/*
+ * GatewayClient sends orders to an OrderGateway as one session.
+ * - Orders are packed up to gateway_max_orders to a datagram, fewer when that is
+ *   all the window has room for, and kept until acknowledged.
+ * - send() blocks while the gateway's window is used up, and after ack_timeout
+ *   without progress resends everything unacknowledged from the gateway's next
+ *   expected sequence.
+ * Not thread-safe; use one client per producer thread.
+ */
+
+class GatewayClient {
+private:
+    static constexpr int ack_timeout_ms = 20;
+
+    int fd;
+    uint32_t session;
+    uint64_t next_sequence;
+    uint64_t acked;
+    uint64_t window;
+    uint64_t rejected;
+    // Sequence a duplicate ack last triggered a resend from, so a burst of them resends once.
+    uint64_t resent_from;
+    // Orders from sequence acked onwards, not yet acknowledged.
+    std::vector<Order> unacked;
+    size_t unacked_start;
+
+    void send_range(uint64_t sequence, const Order* orders, size_t count) {
+        alignas(64) unsigned char datagram[gateway_max_datagram];
+        GatewayHeader header{gateway_magic, gateway_version, static_cast<uint16_t>(count), session, 0, sequence};
+        std::memcpy(datagram, &header, sizeof(header));
+        std::memcpy(datagram + sizeof(header), orders, count * sizeof(Order));
+        // A send the kernel drops is recovered like a lost datagram.
+        (void)::send(fd, datagram, sizeof(header) + count * sizeof(Order), 0);
+    }
+
+    void resend_unacked() {
+        size_t pending = unacked.size() - unacked_start;
+        for (size_t offset = 0; offset < pending; offset += gateway_max_orders) {
+            size_t count = std::min(gateway_max_orders, pending - offset);
+            send_range(acked + offset, unacked.data() + unacked_start + offset, count);
+        }
+    }
+
+    // Waits up to timeout_ms for acks and applies them; returns false on timeout.
+    bool receive_acks(int timeout_ms) {
+        pollfd ready{fd, POLLIN, 0};
+        if (poll(&ready, 1, timeout_ms) <= 0) {
+            return false;
+        }
+        GatewayAck ack;
+        bool progressed = false;
+        while (::recv(fd, &ack, sizeof(ack), MSG_DONTWAIT) == static_cast<ssize_t>(sizeof(ack))) {
+            if (ack.magic != gateway_magic || ack.session != session) {
+                continue;
+            }
+            // A zero window could never be waited out; the gateway's own config refuses it.
+            window = std::max<uint64_t>(ack.window, 1);
+            rejected = ack.rejected_batches;
+            if (ack.next_sequence > acked && ack.next_sequence <= next_sequence) {
+                unacked_start += static_cast<size_t>(ack.next_sequence - acked);
+                acked = ack.next_sequence;
+                progressed = true;
+            } else if (ack.next_sequence == acked && acked < next_sequence && resent_from != acked) {
+                // The gateway is still waiting at acked: something after it was lost.
+                resent_from = acked;
+                resend_unacked();
+            }
+        }
+        if (unacked_start == unacked.size()) {
+            unacked.clear();
+            unacked_start = 0;
+        } else if (unacked_start > unacked.size() / 2) {
+            unacked.erase(unacked.begin(), unacked.begin() + static_cast<std::ptrdiff_t>(unacked_start));
+            unacked_start = 0;
+        }
+        return progressed;
+    }
+
+    void wait_for_ack() {
+        if (!receive_acks(ack_timeout_ms)) {
+            resend_unacked();
+        }
+    }
+
+public:
+    GatewayClient(const std::string& host, uint16_t port, uint32_t session_id, uint64_t initial_window = 4096)
+        : fd(-1), session(session_id), next_sequence(0), acked(0), window(initial_window), rejected(0),
+          resent_from(~uint64_t(0)), unacked_start(0) {
+        if (initial_window == 0) {
+            throw std::invalid_argument("initial_window must be at least 1");
+        }
+        fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("cannot create client socket: ") + std::strerror(errno));
+        }
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (::inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1
+            || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            ::close(fd);
+            throw std::runtime_error("cannot connect gateway client to " + host);
+        }
+    }
+
+    ~GatewayClient() {
+        ::close(fd);
+    }
+
+    GatewayClient(const GatewayClient&) = delete;
+    GatewayClient& operator=(const GatewayClient&) = delete;
+
+    void send(const Order* orders, size_t count) {
+        for (size_t offset = 0; offset < count;) {
+            while (next_sequence - acked >= window) {
+                wait_for_ack();
+            }
+            // A window narrower than a full datagram is filled with a shorter one.
+            size_t credit = static_cast<size_t>(std::min<uint64_t>(window - (next_sequence - acked), gateway_max_orders));
+            size_t chunk = std::min(credit, count - offset);
+            unacked.insert(unacked.end(), orders + offset, orders + offset + chunk);
+            send_range(next_sequence, orders + offset, chunk);
+            next_sequence += chunk;
+            offset += chunk;
+            // Pick up acks already waiting without blocking.
+            receive_acks(0);
+        }
+    }
+
+    // Blocks until the gateway has applied every order sent so far.
+    void flush() {
+        while (acked < next_sequence) {
+            wait_for_ack();
+        }
+    }
+
+    uint64_t acknowledged() const {
+        return acked;
+    }
+
+    uint64_t rejected_batches() const {
+        return rejected;
+    }
+};
+
+/*
+ * Loopback gateway benchmark: client threads, one session each, stream random
+ * orders through an OrderGateway into one OrderBook and wait for every ack.
+ */
+
+void run_gateway_benchmark(int clients, long orders_per_client) {
+    OrderBook<> book;
+    OrderGateway<OrderBook<>>::Config config;
+    config.loopback_only = true;
+    OrderGateway<OrderBook<>> gateway(book, config);
+    gateway.start();
+
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int c = 0; c < clients; c++) {
+        threads.emplace_back([&gateway, c, orders_per_client]() {
+            GatewayClient client("127.0.0.1", gateway.port(), static_cast<uint32_t>(c));
+            std::mt19937 gen(c + 1);
+            std::uniform_int_distribution<> ticker_dist(0, 1023);
+            std::uniform_int_distribution<> quantity_dist(1, 100);
+            std::uniform_int_distribution<Price> price_dist(99 * price_scale, 101 * price_scale);
+            Order batch[gateway_max_orders];
+            for (long sent = 0; sent < orders_per_client;) {
+                size_t count = static_cast<size_t>(std::min<long>(gateway_max_orders, orders_per_client - sent));
+                for (size_t i = 0; i < count; i++) {
+                    batch[i] = Order((gen() & 1) ? Side::Buy : Side::Sell, ticker_dist(gen), quantity_dist(gen),
+                                     price_dist(gen), 0);
+                }
+                client.send(batch, count);
+                sent += static_cast<long>(count);
+            }
+            client.flush();
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    gateway.stop();
+
+    const auto& stats = gateway.stats();
+    std::printf("%d clients, %llu orders in %.3f s (%.0f orders/s), %llu datagrams, %llu duplicates, %llu gaps, "
+                "%llu over window\n",
+                clients, static_cast<unsigned long long>(stats.orders.load()), elapsed.count(),
+                stats.orders.load() / elapsed.count(), static_cast<unsigned long long>(stats.datagrams.load()),
+                static_cast<unsigned long long>(stats.duplicates.load()),
+                static_cast<unsigned long long>(stats.gaps.load()),
+                static_cast<unsigned long long>(stats.over_window.load()));
+}
+#endif
+
+/*
+ * MetricsExporter prints a metrics report from any engine with
+ * print_metrics(std::ostream&, size_t) every interval on its own thread.
+ * Reports only read the metrics, so the matching threads are not slowed
+ * beyond the cache misses of their counters being read.
+ */
+
+template <typename Engine>
+class MetricsExporter {
+private:
+    Engine& engine;
+    std::ostream& out;
+    std::chrono::milliseconds interval;
+    std::atomic<bool> running;
+    std::thread worker;
+
+    void run() {
+        auto next = std::chrono::steady_clock::now() + interval;
+        while (running.load(std::memory_order_acquire)) {
+            if (std::chrono::steady_clock::now() >= next) {
+                engine.print_metrics(out);
+                next += interval;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+public:
+    MetricsExporter(Engine& source, std::ostream& stream, std::chrono::milliseconds period)
+        : engine(source), out(stream), interval(period), running(false) {}
+
+    ~MetricsExporter() {
+        stop();
+    }
+
+    void start() {
+        running.store(true, std::memory_order_release);
+        worker = std::thread(&MetricsExporter::run, this);
+    }
+
+    void stop() {
+        running.store(false, std::memory_order_release);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+};
+
+/*
+ * BookCompactor runs OrderBook::compact() every interval on its own thread,
+ * so quiet tickers hand back their free slabs and bursty ones are repacked
+ * without the matching threads doing it. The book needs a real lock policy.
+ */
+
+template <typename Book>
+class BookCompactor {
+private:
+    Book& book;
+    std::chrono::milliseconds interval;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> released;
+    std::thread worker;
+
+    void run() {
+        auto next = std::chrono::steady_clock::now() + interval;
+        while (running.load(std::memory_order_acquire)) {
+            if (std::chrono::steady_clock::now() >= next) {
+                released.fetch_add(book.compact(), std::memory_order_relaxed);
+                next += interval;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+public:
+    BookCompactor(Book& target, std::chrono::milliseconds period)
+        : book(target), interval(period), running(false), released(0) {}
+
+    ~BookCompactor() {
+        stop();
+    }
+
+    void start() {
+        running.store(true, std::memory_order_release);
+        worker = std::thread(&BookCompactor::run, this);
+    }
+
+    void stop() {
+        running.store(false, std::memory_order_release);
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    // Bytes released by all passes so far.
+    uint64_t bytes_released() const {
+        return released.load(std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Simulates real-time stock transactions with random orders.
+ * - Creates buy/sell orders with random prices and quantities.
+ * - Runs continuously with multiple threads to mimic real-world order flow.
+ * Works with any engine exposing add_order(Side, ticker, quantity, price).
+ */
+
+template <typename Engine>
+void simulate_market_activity(Engine& engine, int iterations) {
+    std::random_device rd;
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<> ticker_dist(0, 1023);
+    std::uniform_int_distribution<> quantity_dist(1, 100);
+    std::uniform_int_distribution<Price> price_dist(10 * price_scale, 500 * price_scale);
+    std::uniform_int_distribution<> type_dist(0, 1);
+
+    for (int i = 0; i < iterations; i++) {
+        Side side = type_dist(gen) ? Side::Buy : Side::Sell;
+        int ticker = ticker_dist(gen);
+        uint32_t quantity = quantity_dist(gen);
+        Price price = price_dist(gen);
+        try {
+            engine.add_order(side, ticker, quantity, price);
+        } catch (const std::exception& e) {
+            // E.g. a failed journal: this trader stops instead of taking the process down.
+            std::fprintf(stderr, "order rejected: %s\n", e.what());
+            return;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+/*
+ * Microbenchmark for per-ticker lock layout.
+ * - Every thread acquires and releases the lock of its own ticker and updates that
+ *   ticker's header word, so no two threads ever touch the same ticker.
+ * - "packed" uses one-byte flags and headers laid out back to back, as the books
+ *   used to be; "padded" uses one cache-line-aligned slot per ticker like TickerBook.
+ * Any slowdown of packed relative to padded as threads are added is false sharing.
+ */
+
+struct PackedTickerLocks {
+    std::vector<std::atomic_flag> locks;
+    std::vector<uint64_t> headers;
+
+    explicit PackedTickerLocks(int tickers) : locks(tickers), headers(tickers, 0) {}
+
+    void touch(int ticker) {
+        while (locks[ticker].test_and_set(std::memory_order_acquire));
+        headers[ticker]++;
+        locks[ticker].clear(std::memory_order_release);
+    }
+};
+
+struct PaddedTickerLocks {
+    struct alignas(64) Slot {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        uint64_t header = 0;
+    };
+    std::unique_ptr<Slot[]> slots;
+
+    explicit PaddedTickerLocks(int tickers) : slots(new Slot[tickers]) {}
+
+    void touch(int ticker) {
+        while (slots[ticker].lock.test_and_set(std::memory_order_acquire));
+        slots[ticker].header++;
+        slots[ticker].lock.clear(std::memory_order_release);
+    }
+};
+
+template <typename Layout>
+double measure_lock_layout(int thread_count, long iterations_per_thread) {
+    Layout layout(thread_count);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&layout, &go, t, iterations_per_thread]() {
+            while (!go.load(std::memory_order_acquire));
+            for (long i = 0; i < iterations_per_thread; i++) {
+                layout.touch(t);
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return thread_count * iterations_per_thread / elapsed.count();
+}
+
+void run_lock_layout_benchmark() {
+    constexpr long iterations_per_thread = 2000000;
+    std::printf("%8s %18s %18s %8s\n", "threads", "packed ops/s", "padded ops/s", "speedup");
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        double packed = measure_lock_layout<PackedTickerLocks>(threads, iterations_per_thread);
+        double padded = measure_lock_layout<PaddedTickerLocks>(threads, iterations_per_thread);
+        std::printf("%8d %18.0f %18.0f %7.2fx\n", threads, packed, padded, padded / packed);
+    }
+}
+
+/*
+ * Lock policy benchmark: the same contended order flow through OrderBook
+ * instantiated with each lock policy, and through a CombiningEngine. All
+ * threads trade a handful of tickers so the per-ticker locks are genuinely
+ * fought over.
+ */
+
+template <typename Engine>
+double measure_lock_policy(int thread_count, int orders_per_thread, int tickers) {
+    Engine book;
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+        threads.emplace_back([&book, &go, t, orders_per_thread, tickers]() {
+            std::mt19937 gen(t + 1);
+            std::uniform_int_distribution<> ticker_dist(0, tickers - 1);
+            std::uniform_int_distribution<> quantity_dist(1, 100);
+            std::uniform_int_distribution<Price> price_dist(99 * price_scale, 101 * price_scale);
+            while (!go.load(std::memory_order_acquire));
+            for (int i = 0; i < orders_per_thread; i++) {
+                Side side = (i & 1) ? Side::Buy : Side::Sell;
+                book.add_order(side, ticker_dist(gen), quantity_dist(gen), price_dist(gen));
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(thread_count) * orders_per_thread / elapsed.count();
+}
+
+void run_lock_policy_benchmark() {
+    constexpr int orders_per_thread = 50000;
+    constexpr int tickers = 4;
+    std::printf("%8s %16s %16s %16s %18s\n", "threads", "ttas orders/s", "ticket orders/s", "mutex orders/s",
+                "combining orders/s");
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        double ttas = measure_lock_policy<OrderBook<TTASSpinLock>>(threads, orders_per_thread, tickers);
+        double ticket = measure_lock_policy<OrderBook<TicketLock>>(threads, orders_per_thread, tickers);
+        double mutex = measure_lock_policy<OrderBook<MutexLock>>(threads, orders_per_thread, tickers);
+        double combining = measure_lock_policy<CombiningEngine>(threads, orders_per_thread, tickers);
+        std::printf("%8d %16.0f %16.0f %16.0f %18.0f\n", threads, ttas, ticket, mutex, combining);
+    }
+}
+
+/*
+ * LatencyHistogram is an HDR-style log-linear histogram of nanosecond latencies.
+ * - Values below 2^sub_bucket_bits are counted exactly; larger values are bucketed
+ *   by their highest set bit and the next sub_bucket_bits - 1 bits below it,
+ *   keeping relative error under 1% across the whole 64-bit range.
+ * - Recording is a bit scan, a shift and an increment.
+ * Percentiles report the highest value equivalent to the matching bucket.
+ */
+
+class LatencyHistogram {
+private:
+    static constexpr int sub_bucket_bits = 8;
+    static constexpr uint64_t sub_bucket_count = uint64_t(1) << sub_bucket_bits;
+    static constexpr uint64_t half_count = sub_bucket_count / 2;
+    static constexpr size_t bucket_slots = sub_bucket_count + (64 - sub_bucket_bits + 1) * half_count;
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+
+    static size_t index_of(uint64_t value) {
+        if (value < sub_bucket_count) {
+            return static_cast<size_t>(value);
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - (sub_bucket_bits - 1);
+        uint64_t sub = value >> shift;
+        return static_cast<size_t>(sub_bucket_count + (shift - 1) * half_count + (sub - half_count));
+    }
+
+    static uint64_t highest_value_at(size_t index) {
+        if (index < sub_bucket_count) {
+            return index;
+        }
+        uint64_t offset = index - sub_bucket_count;
+        int shift = static_cast<int>(offset / half_count) + 1;
+        uint64_t sub = offset % half_count + half_count;
+        return ((sub + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(bucket_slots, 0), total(0), max_value(0) {}
+
+    void record(uint64_t value) {
+        counts[index_of(value)]++;
+        total++;
+        max_value = std::max(max_value, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < bucket_slots; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t max() const {
+        return max_value;
+    }
+
+    // Value at or below which the given percentage (0-100) of recordings fall.
+    uint64_t percentile(double percent) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t target = static_cast<uint64_t>(std::ceil(percent / 100.0 * total));
+        target = std::max<uint64_t>(target, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_slots; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                return std::min(highest_value_at(i), max_value);
+            }
+        }
+        return max_value;
+    }
+};
+
+/*
+ * ZipfDistribution draws ranks 0..n-1 with probability proportional to 1/(rank+1)^s,
+ * so rank 0 is the hottest. An exponent of 0 degenerates to a uniform draw.
+ */
+
+class ZipfDistribution {
+private:
+    std::vector<double> cdf;
+    std::uniform_real_distribution<double> unit;
+
+public:
+    ZipfDistribution(int n, double exponent) : cdf(n), unit(0.0, 1.0) {
+        double sum = 0.0;
+        for (int k = 0; k < n; k++) {
+            sum += 1.0 / std::pow(k + 1.0, exponent);
+            cdf[k] = sum;
+        }
+        for (double& c : cdf) {
+            c /= sum;
+        }
+    }
+
+    template <typename Generator>
+    int operator()(Generator& gen) {
+        double u = unit(gen);
+        auto it = std::lower_bound(cdf.begin(), cdf.end(), u);
+        return it == cdf.end() ? static_cast<int>(cdf.size()) - 1 : static_cast<int>(it - cdf.begin());
+    }
+};
+
+/*
+ * Auction uncross benchmark: the same Zipf-skewed call-phase flow is loaded into two
+ * books, one is uncrossed on a single worker and the other on a WorkStealingPool,
+ * and both must clear every ticker at the same price, volume and imbalance.
+ */
+
+void run_auction_benchmark(int tickers, long orders_per_ticker, int threads) {
+    OrderBook<> serial_book;
+    OrderBook<> parallel_book;
+    serial_book.begin_auction();
+    parallel_book.begin_auction();
+    std::mt19937 gen(1);
+    ZipfDistribution ticker_dist(tickers, 0.8);
+    std::uniform_int_distribution<> quantity_dist(1, 100);
+    std::normal_distribution<double> price_dist(100.0, 0.5);
+    long total = static_cast<long>(tickers) * orders_per_ticker;
+    for (long i = 0; i < total; i++) {
+        Side side = (gen() & 1) ? Side::Buy : Side::Sell;
+        int ticker = ticker_dist(gen);
+        uint32_t quantity = static_cast<uint32_t>(quantity_dist(gen));
+        Price price = to_ticks(price_dist(gen));
+        serial_book.add_order(side, ticker, quantity, price);
+        parallel_book.add_order(side, ticker, quantity, price);
+    }
+
+    WorkStealingPool single(1);
+    WorkStealingPool pool(static_cast<size_t>(std::max(threads, 1)));
+    std::vector<AuctionResult> serial_results, parallel_results;
+    auto start = std::chrono::steady_clock::now();
+    serial_book.uncross_auction(single, serial_results);
+    std::chrono::duration<double> serial = std::chrono::steady_clock::now() - start;
+    start = std::chrono::steady_clock::now();
+    parallel_book.uncross_auction(pool, parallel_results);
+    std::chrono::duration<double> parallel = std::chrono::steady_clock::now() - start;
+
+    uint64_t volume = 0;
+    bool same = serial_results.size() == parallel_results.size();
+    for (size_t i = 0; same && i < serial_results.size(); i++) {
+        const AuctionResult& a = serial_results[i];
+        const AuctionResult& b = parallel_results[i];
+        same = a.ticker == b.ticker && a.price == b.price && a.volume == b.volume && a.imbalance == b.imbalance;
+        volume += a.volume;
+    }
+    if (!same) {
+        throw std::runtime_error("parallel uncross diverged from the serial one");
+    }
+    std::printf("%zu tickers uncrossed from %ld orders, %llu shares executed\n", serial_results.size(), total,
+                static_cast<unsigned long long>(volume));
+    std::printf("serial %.3f ms, %zu workers %.3f ms (%.2fx), %llu steals\n", serial.count() * 1e3, pool.size(),
+                parallel.count() * 1e3, serial.count() / parallel.count(),
+                static_cast<unsigned long long>(pool.steals()));
+}
+
+/*
+ * Benchmark harness for OrderBook<> throughput and latency.
+ * - Producer threads submit a configurable mix of limit orders and cancels with
+ *   Zipfian ticker skew and a uniform or normal price distribution around $100.
+ * - Books can be pre-populated with resting depth on both sides before timing.
+ * - Each call is timed on its own: add latency covers the add and every fill it
+ *   triggers, cancel latency covers the lookup and unlink.
+ * Results are printed as a table, or as one JSON object with --json.
+ */
+
+struct BenchmarkConfig {
+    int threads = 4;
+    int tickers = 1024;
+    long orders_per_thread = 200000;
+    // 0 gives uniform ticker selection; around 1 gives a few very hot tickers.
+    double zipf_exponent = 0.0;
+    // "uniform" or "normal".
+    std::string price_distribution = "uniform";
+    // Half-width (uniform) or two standard deviations (normal) of prices around the mid, in ticks.
+    Price price_band = 100;
+    double cancel_ratio = 0.0;
+    // Fraction of new orders sent as immediate-or-cancel instead of resting limits.
+    double ioc_ratio = 0.0;
+    // Resting orders placed per side of every ticker before the timed run.
+    int book_depth = 0;
+    bool json = false;
+    // When set, the order stream (including the depth build-up) is recorded for replay.
+    std::string record_path;
+    // When set, orders and fills are journaled to this directory (exclusive with record_path).
+    std::string journal_dir;
+    // Print the hot-path metrics report (to stderr with --json) after the run.
+    bool metrics = false;
+    // Back every ticker with a dense PriceLadderBook instead of sorted levels.
+    bool ladder = false;
+    // Print the memory report (to stderr with --json), compact the book and print it again.
+    bool memory = false;
+};
+
+inline void print_latency_json(const char* name, const LatencyHistogram& histogram) {
+    std::printf("\"%s\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p99_9\":%llu,\"max\":%llu}", name,
+                static_cast<unsigned long long>(histogram.count()),
+                static_cast<unsigned long long>(histogram.percentile(50.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.9)),
+                static_cast<unsigned long long>(histogram.max()));
+}
+
+inline void print_latency_row(const char* name, const LatencyHistogram& histogram) {
+    std::printf("%-8s %12llu %10llu %10llu %10llu %10llu\n", name,
+                static_cast<unsigned long long>(histogram.count()),
+                static_cast<unsigned long long>(histogram.percentile(50.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.0)),
+                static_cast<unsigned long long>(histogram.percentile(99.9)),
+                static_cast<unsigned long long>(histogram.max()));
+}
+
+template <typename Book>
+void run_benchmark_on(const BenchmarkConfig& config) {
+    constexpr Price mid_price = 100 * price_scale;
+    constexpr size_t cancel_window = 1024;
+
+    FillDigest counter;
+    ExecutionReporter reporter;
+    reporter.add_listener(&counter);
+    std::unique_ptr<OrderLogWriter> record_log;
+    OrderLogSink* order_log = nullptr;
+    if (!config.record_path.empty()) {
+        record_log.reset(new OrderLogWriter(config.record_path));
+        order_log = record_log.get();
+    }
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+    std::unique_ptr<Journal> journal;
+    if (!config.journal_dir.empty()) {
+        Journal::Config journal_config;
+        journal_config.directory = config.journal_dir;
+        journal.reset(new Journal(journal_config));
+        order_log = journal.get();
+    }
+#endif
+    reporter.start();
+    Book book;
+    book.set_execution_reporter(&reporter);
+    book.set_order_log(order_log);
+
+    // Resting depth: bids just below the mid and asks just above it, so the timed
+    // flow trades into populated levels.
+    Price depth_span = std::max<Price>(config.price_band, 1);
+    for (int ticker = 0; ticker < config.tickers; ticker++) {
+        for (int i = 0; i < config.book_depth; i++) {
+            Price offset = 1 + i % depth_span;
+            book.add_order(Side::Buy, ticker, 100, mid_price - offset);
+            book.add_order(Side::Sell, ticker, 100, mid_price + offset);
+        }
+    }
+
+    std::vector<LatencyHistogram> add_latency(config.threads);
+    std::vector<LatencyHistogram> cancel_latency(config.threads);
+    std::atomic<uint64_t> rejected(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < config.threads; t++) {
+        threads.emplace_back([&, t]() {
+            std::mt19937_64 gen(0x5eed + t);
+            ZipfDistribution ticker_dist(config.tickers, config.zipf_exponent);
+            std::uniform_int_distribution<> quantity_dist(1, 100);
+            std::uniform_int_distribution<Price> uniform_price(mid_price - config.price_band, mid_price + config.price_band);
+            std::normal_distribution<double> normal_price(static_cast<double>(mid_price), config.price_band / 2.0);
+            std::uniform_real_distribution<double> unit(0.0, 1.0);
+            bool normal = config.price_distribution == "normal";
+            std::vector<uint64_t> recent(cancel_window, 0);
+            size_t recent_count = 0;
+
+            while (!go.load(std::memory_order_acquire));
+            for (long i = 0; i < config.orders_per_thread; i++) {
+                if (recent_count > 0 && unit(gen) < config.cancel_ratio) {
+                    uint64_t order_id = recent[gen() % std::min(recent_count, cancel_window)];
+                    auto start = std::chrono::steady_clock::now();
+                    book.cancel_order(order_id);
+                    auto end = std::chrono::steady_clock::now();
+                    cancel_latency[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                    continue;
+                }
+                Side side = (gen() & 1) ? Side::Buy : Side::Sell;
+                int ticker = ticker_dist(gen);
+                uint32_t quantity = quantity_dist(gen);
+                Price price = normal ? std::max<Price>(1, std::llround(normal_price(gen))) : uniform_price(gen);
+                // Only drawn when enabled, so flows without IOC orders stay identical.
+                OrderType type = config.ioc_ratio > 0.0 && unit(gen) < config.ioc_ratio ? OrderType::ImmediateOrCancel
+                                                                                        : OrderType::Limit;
+                auto start = std::chrono::steady_clock::now();
+                uint64_t order_id;
+                try {
+                    order_id = book.add_order(side, ticker, quantity, price, type);
+                } catch (const std::exception&) {
+                    // A ladder book's price outside the ticker's band, or a failed journal or
+                    // capture; anything else must not escape the thread and terminate the run.
+                    rejected.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                auto end = std::chrono::steady_clock::now();
+                add_latency[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                if (type == OrderType::Limit) {
+                    recent[recent_count++ % cancel_window] = order_id;
+                }
+            }
+        });
+    }
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto& t : threads) {
+        t.join();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    if (record_log) {
+        record_log->close();
+        if (record_log->failed()) {
+            std::fprintf(stderr, "order log %s is incomplete: %s\n", config.record_path.c_str(),
+                         std::strerror(record_log->error()));
+        }
+    }
+    reporter.stop();
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+    if (journal) {
+        journal->close();
+        if (journal->failed()) {
+            std::fprintf(stderr, "journal failed after sequence %llu: %s\n",
+                         static_cast<unsigned long long>(journal->durable_sequence()), std::strerror(journal->error()));
+        }
+    }
+#endif
+
+    LatencyHistogram adds, cancels;
+    for (int t = 0; t < config.threads; t++) {
+        adds.merge(add_latency[t]);
+        cancels.merge(cancel_latency[t]);
+    }
+    double operations = static_cast<double>(adds.count() + cancels.count());
+    double ops_per_sec = operations / elapsed.count();
+
+    if (config.json) {
+        std::printf("{\"threads\":%d,\"tickers\":%d,\"orders_per_thread\":%ld,\"zipf\":%g,\"prices\":\"%s\","
+                    "\"price_band\":%lld,\"cancel_ratio\":%g,\"ioc_ratio\":%g,\"book_depth\":%d,\"seconds\":%.6f,"
+                    "\"ops_per_sec\":%.0f,\"fills\":%llu,\"fill_digest\":\"%016llx\",\"book\":\"%s\",\"rejected\":%llu,",
+                    config.threads, config.tickers, config.orders_per_thread, config.zipf_exponent,
+                    config.price_distribution.c_str(), static_cast<long long>(config.price_band), config.cancel_ratio,
+                    config.ioc_ratio, config.book_depth, elapsed.count(), ops_per_sec, static_cast<unsigned long long>(counter.fills),
+                    static_cast<unsigned long long>(counter.digest), config.ladder ? "ladder" : "levels",
+                    static_cast<unsigned long long>(rejected.load()));
+        print_latency_json("add_latency_ns", adds);
+        std::printf(",");
+        print_latency_json("cancel_latency_ns", cancels);
+        std::printf("}\n");
+    } else {
+        std::printf("%d threads, %d tickers, %.3f s, %.0f ops/s, %llu fills\n", config.threads, config.tickers,
+                    elapsed.count(), ops_per_sec, static_cast<unsigned long long>(counter.fills));
+        if (rejected.load() > 0) {
+            std::printf("%llu orders rejected (outside their ladder band, or not journalled or recorded)\n",
+                        static_cast<unsigned long long>(rejected.load()));
+        }
+        std::printf("%-8s %12s %10s %10s %10s %10s\n", "latency", "count", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+        print_latency_row("add", adds);
+        print_latency_row("cancel", cancels);
+    }
+    if (config.metrics) {
+        std::fflush(stdout);
+        book.print_metrics(config.json ? std::cerr : std::cout);
+    }
+    if (config.memory) {
+        std::fflush(stdout);
+        std::ostream& out = config.json ? std::cerr : std::cout;
+        book.print_memory(out);
+        // The first pass only sees every ticker as active; by the second they are all quiet.
+        size_t released = book.compact();
+        released += book.compact();
+        out << "compaction released " << released << " bytes\n";
+        book.print_memory(out);
+    }
+}
+
+void run_benchmark(const BenchmarkConfig& config) {
+    if (config.ladder) {
+        run_benchmark_on<LadderOrderBook<>>(config);
+    } else {
+        run_benchmark_on<OrderBook<>>(config);
+    }
+}
+
+// Parses the options following --bench.
+BenchmarkConfig parse_benchmark_args(int argc, char** argv, int first) {
+    BenchmarkConfig config;
+    for (int i = first; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--json") {
+            config.json = true;
+        } else if (arg == "--metrics") {
+            config.metrics = true;
+        } else if (arg == "--ladder") {
+            config.ladder = true;
+        } else if (arg == "--memory") {
+            config.memory = true;
+        } else if (arg == "--threads" && has_value) {
+            config.threads = std::stoi(argv[++i]);
+        } else if (arg == "--tickers" && has_value) {
+            config.tickers = std::stoi(argv[++i]);
+        } else if (arg == "--orders" && has_value) {
+            config.orders_per_thread = std::stol(argv[++i]);
+        } else if (arg == "--zipf" && has_value) {
+            config.zipf_exponent = std::stod(argv[++i]);
+        } else if (arg == "--prices" && has_value) {
+            config.price_distribution = argv[++i];
+        } else if (arg == "--band" && has_value) {
+            config.price_band = std::stoll(argv[++i]);
+        } else if (arg == "--cancel-ratio" && has_value) {
+            config.cancel_ratio = std::stod(argv[++i]);
+        } else if (arg == "--ioc-ratio" && has_value) {
+            config.ioc_ratio = std::stod(argv[++i]);
+        } else if (arg == "--depth" && has_value) {
+            config.book_depth = std::stoi(argv[++i]);
+        } else if (arg == "--record" && has_value) {
+            config.record_path = argv[++i];
+        } else if (arg == "--journal" && has_value) {
+            config.journal_dir = argv[++i];
+        } else {
+            throw std::invalid_argument("unknown benchmark option: " + arg);
+        }
+    }
+    if (config.threads < 1 || config.tickers < 1) {
+        throw std::invalid_argument("--threads and --tickers must be at least 1");
+    }
+    if (static_cast<size_t>(config.tickers) > OrderBook<>::default_max_symbols) {
+        throw std::invalid_argument("--tickers must be at most " + std::to_string(OrderBook<>::default_max_symbols));
+    }
+    if (!config.record_path.empty() && !config.journal_dir.empty()) {
+        throw std::invalid_argument("--record and --journal cannot be combined");
+    }
+    if (config.price_distribution != "uniform" && config.price_distribution != "normal") {
+        throw std::invalid_argument("--prices must be uniform or normal");
+    }
+    return config;
+}
+
+/*
+ * Deterministic replay of a recorded order log.
+ * - Records are applied single-threaded, in log order, to a fresh OrderBook with
+ *   their recorded order IDs; there is no RNG and no sleeping.
+ * - Where mmap is available the log is read in place from the mapped file.
+ * - A book snapshot can be restored first, so only the flow since it was taken is replayed.
+ * - Fills are folded into a FillDigest (and optionally written out), so two engine
+ *   versions can be checked for bit-identical output on the same log.
+ */
+
+struct ReplayResult {
+    uint64_t records = 0;
+    uint64_t fills = 0;
+    uint64_t fill_digest = 0;
+    double seconds = 0.0;
+};
+
+template <typename Book>
+inline void apply_log_record(Book& book, const OrderLogRecord& record) {
+    switch (record.type) {
+    case OrderLogType::Add:
+        book.add_order(Order(record.side, record.ticker, record.quantity, record.price, record.order_id,
+                             record.order_type));
+        break;
+    case OrderLogType::Cancel:
+        book.cancel_order(record.order_id);
+        break;
+    case OrderLogType::Modify:
+        book.modify_order(record.order_id, record.quantity, record.price);
+        break;
+    case OrderLogType::AuctionOpen:
+        book.begin_auction(record.ticker);
+        break;
+    case OrderLogType::AuctionUncross:
+        book.uncross_auction(record.ticker);
+        break;
+    }
+}
+
+ReplayResult replay_order_log(const std::string& path, const std::string& fills_path = "",
+                              const std::string& snapshot_path = "") {
+    FillDigest digest(fills_path);
+    ExecutionReporter reporter;
+    reporter.add_listener(&digest);
+    reporter.start();
+    OrderBook<NullLock> book;
+    if (!snapshot_path.empty()) {
+        book.restore(snapshot_path);
+    }
+    book.set_execution_reporter(&reporter);
+
+    ReplayResult result;
+#ifdef STOCK_ENGINE_HAS_MMAP
+    constexpr size_t release_window = 1 << 21;
+    MappedOrderLog log(path);
+    const OrderLogRecord* records = log.records();
+    size_t count = log.size();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        apply_log_record(book, records[i]);
+        if ((i + 1) % release_window == 0) {
+            log.release_before(i + 1);
+        }
+    }
+    result.records = count;
+#else
+    OrderLogReader reader(path);
+    auto start = std::chrono::steady_clock::now();
+    while (size_t count = reader.next()) {
+        const OrderLogRecord* records = reader.records();
+        for (size_t i = 0; i < count; i++) {
+            apply_log_record(book, records[i]);
+        }
+        result.records += count;
+    }
+#endif
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    reporter.stop();
+    digest.close();
+    if (digest.failed()) {
+        throw std::runtime_error("fill output is incomplete: " + fills_path + ": " + std::strerror(digest.error()));
+    }
+
+    result.fills = digest.fills;
+    result.fill_digest = digest.digest;
+    result.seconds = elapsed.count();
+    return result;
+}
+
+/*
+ * Self-tests (--self-test) for behaviour that has to hold however the engine is tuned.
+ * Each check throws std::runtime_error naming what failed, so a failure exits non-zero.
+ */
+
+inline void self_check(bool condition, const char* what) {
+    if (!condition) {
+        throw std::runtime_error(std::string("self-test failed: ") + what);
+    }
+}
+
+// More distinct tickers than the symbol table holds: new ones are rejected and lookups still return.
+void test_symbol_table_overflow() {
+    constexpr int32_t max_symbols = 4;
+    OrderBook<> book(0, max_symbols);
+    int rejected = 0;
+    for (int32_t ticker = 0; ticker < 64 * max_symbols; ticker++) {
+        try {
+            book.add_order(Side::Buy, ticker, 1, 100 * price_scale);
+        } catch (const std::length_error&) {
+            rejected++;
+        }
+    }
+    self_check(rejected == 63 * max_symbols, "tickers beyond capacity are rejected");
+    self_check(book.ticker_count() == static_cast<size_t>(max_symbols), "capacity tickers have books");
+    std::vector<PriceLevel> bids, asks;
+    for (int32_t ticker = 64 * max_symbols; ticker < 128 * max_symbols; ticker++) {
+        self_check(book.top_of_book(ticker).bid_price == 0, "unknown ticker has an empty quote");
+        self_check(!book.in_auction(ticker), "unknown ticker is not in an auction");
+        book.match_order(ticker);
+        book.depth_snapshot(ticker, 10, bids, asks);
+        self_check(bids.empty() && asks.empty(), "unknown ticker has no depth");
+    }
+    self_check(book.top_of_book(0).bid_price == 100 * price_scale, "admitted tickers keep trading");
+    std::printf("symbol table overflow: ok\n");
+}
+
+// A shard whose book refuses an order counts it and keeps matching.
+void test_sharded_rejections() {
+    ShardedEngine::Config config;
+    config.shard_count = 1;
+    config.max_symbols_per_shard = 1;
+    ShardedEngine engine(config);
+    engine.start();
+    engine.add_order(Side::Buy, 0, 10, 100 * price_scale);
+    engine.add_order(Side::Buy, 1, 10, 100 * price_scale);
+    OrderAck refused = engine.add_order_async(Side::Buy, 2, 10, 100 * price_scale).get();
+    OrderAck filled = engine.add_order_async(Side::Sell, 0, 10, 100 * price_scale).get();
+    engine.stop();
+    self_check(refused.status == OrderStatus::Rejected && !refused.reason.empty(), "refused async order is acked Rejected");
+    self_check(filled.status == OrderStatus::Filled && filled.filled_quantity == 10, "shard keeps matching after a rejection");
+    self_check(engine.rejected() == 2, "shard counts rejected orders");
+    std::printf("sharded engine rejections: ok\n");
+}
+
+/*
+ * ShardedEngine IDs with several producers on the same tickers: every ID is unique,
+ * matches what its producer was given, and increases in the order each ticker applies them.
+ */
+void test_sharded_order_ids() {
+    struct AddLog : OrderLogSink {
+        std::mutex mutex;
+        std::vector<std::vector<uint64_t>> applied = std::vector<std::vector<uint64_t>>(4);
+
+        void append(OrderLogType type, const Order& order) override {
+            if (type == OrderLogType::Add) {
+                std::lock_guard<std::mutex> guard(mutex);
+                applied[order.ticker].push_back(order.order_id);
+            }
+        }
+    };
+    ShardedEngine::Config config;
+    config.shard_count = 2;
+    ShardedEngine engine(config);
+    AddLog log;
+    engine.set_order_log(&log);
+    engine.start();
+    constexpr int producers = 2;
+    constexpr int orders = 5000;
+    std::vector<std::vector<uint64_t>> returned(producers);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&engine, &returned, p]() {
+            for (int i = 0; i < orders; i++) {
+                Side side = (i + p) % 2 ? Side::Buy : Side::Sell;
+                returned[p].push_back(engine.add_order(side, i % 4, 1, (100 + i % 7) * price_scale));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    engine.stop();
+    std::vector<uint64_t> given;
+    for (const std::vector<uint64_t>& ids : returned) {
+        given.insert(given.end(), ids.begin(), ids.end());
+    }
+    std::vector<uint64_t> logged;
+    bool increasing = true;
+    for (const std::vector<uint64_t>& ids : log.applied) {
+        increasing = increasing && std::is_sorted(ids.begin(), ids.end())
+            && std::adjacent_find(ids.begin(), ids.end()) == ids.end();
+        logged.insert(logged.end(), ids.begin(), ids.end());
+    }
+    std::sort(given.begin(), given.end());
+    std::sort(logged.begin(), logged.end());
+    self_check(increasing, "sharded IDs increase within each ticker");
+    self_check(given.size() == size_t(producers) * orders && given == logged, "producers get the IDs the shards apply");
+    self_check(std::adjacent_find(given.begin(), given.end()) == given.end(), "sharded IDs are unique");
+    std::printf("sharded order IDs: ok\n");
+}
+
+/*
+ * One writer publishing quotes whose fields are tied together while readers spin on
+ * read(): no reader ever sees fields from two different quotes, and sequences never
+ * go backwards.
+ */
+void test_quote_seqlock() {
+    QuoteSeqlock quote;
+    constexpr uint64_t publishes = 200000;
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> torn(0);
+    std::atomic<uint64_t> reads(0);
+    std::atomic<int> started(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&quote, &done, &torn, &reads, &started]() {
+            started.fetch_add(1, std::memory_order_release);
+            uint64_t last_sequence = 0;
+            uint64_t count = 0;
+            do {
+                TopOfBook top = quote.read();
+                uint64_t k = static_cast<uint64_t>(top.bid_price);
+                // Sequence 0 is the empty quote before the first publish.
+                if (top.sequence == 0) {
+                    continue;
+                }
+                if (top.bid_size != 3 * k || top.ask_price != top.bid_price + 1 || top.ask_size != 7 * k
+                    || top.sequence < last_sequence) {
+                    torn.fetch_add(1, std::memory_order_relaxed);
+                }
+                last_sequence = top.sequence;
+                count++;
+            } while (!done.load(std::memory_order_acquire));
+            reads.fetch_add(count, std::memory_order_relaxed);
+        });
+    }
+    while (started.load(std::memory_order_acquire) < 3) {
+        std::this_thread::yield();
+    }
+    for (uint64_t k = 1; k <= publishes; k++) {
+        quote.publish(static_cast<Price>(k), 3 * k, static_cast<Price>(k + 1), 7 * k);
+    }
+    done.store(true, std::memory_order_release);
+    for (std::thread& reader : readers) {
+        reader.join();
+    }
+    TopOfBook last = quote.read();
+    self_check(torn.load() == 0, "readers never see a torn quote");
+    self_check(reads.load() > 0 && last.sequence == publishes && last.bid_price == static_cast<Price>(publishes),
+               "every publish is counted and the last quote is visible");
+    std::printf("quote seqlock: ok\n");
+}
+
+/*
+ * Producers racing on a few combining shards with a small ring, so some of them
+ * combine for the others and some find the ring full: every order is applied once,
+ * under the ID its producer was given.
+ */
+void test_combining_engine() {
+    struct AddLog : OrderLogSink {
+        std::mutex mutex;
+        std::vector<Order> applied;
+
+        void append(OrderLogType type, const Order& order) override {
+            if (type == OrderLogType::Add) {
+                std::lock_guard<std::mutex> guard(mutex);
+                applied.push_back(order);
+            }
+        }
+    };
+    CombiningEngine::Config config;
+    config.shard_count = 2;
+    config.queue_capacity = 16;
+    CombiningEngine engine(config);
+    AddLog log;
+    engine.set_order_log(&log);
+    constexpr int producers = 4;
+    constexpr int orders = 5000;
+    std::vector<std::vector<uint64_t>> returned(producers);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&engine, &returned, p]() {
+            for (int i = 0; i < orders; i++) {
+                Side side = (i + p) % 2 ? Side::Buy : Side::Sell;
+                // The quantity names the producer, so each logged order can be traced back.
+                returned[p].push_back(engine.add_order(side, i % 6, static_cast<uint32_t>(p + 1),
+                                                       (100 + i % 5) * price_scale));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    std::map<uint64_t, uint32_t> logged;
+    bool unique = true;
+    for (const Order& order : log.applied) {
+        unique = logged.emplace(order.order_id, order.quantity).second && unique;
+    }
+    bool traced = true;
+    for (int p = 0; p < producers; p++) {
+        for (uint64_t id : returned[p]) {
+            auto it = logged.find(id);
+            traced = traced && it != logged.end() && it->second == static_cast<uint32_t>(p + 1);
+        }
+    }
+    self_check(unique, "no order is applied twice");
+    self_check(log.applied.size() == size_t(producers) * orders && traced,
+               "every submitted order is applied under its producer's ID");
+    self_check(engine.rejected() == 0, "nothing is rejected");
+    std::printf("combining engine: ok\n");
+}
+
+/*
+ * A burst that is mostly cancelled, then compacted by a BookCompactor: memory is
+ * released, depth, quotes and order IDs are unchanged, and the relocated orders can
+ * still be cancelled, reduced in place, repriced and filled in time priority.
+ */
+void test_book_compaction() {
+    OrderBook<> book;
+    std::vector<uint64_t> buys, sells;
+    for (int i = 0; i < 8000; i++) {
+        bool buy = i % 2 == 0;
+        Price price = (buy ? 90 + i % 10 : 101 + i % 10) * price_scale;
+        uint64_t id = book.add_order(buy ? Side::Buy : Side::Sell, 1, 10, price);
+        // One buy at 90 and one sell at 102 survive out of every 20 orders.
+        if (i % 20 < 2) {
+            (buy ? buys : sells).push_back(id);
+        } else {
+            book.cancel_order(id);
+        }
+    }
+    std::vector<PriceLevel> bids, asks, bids_after, asks_after;
+    book.depth_snapshot(1, 100, bids, asks);
+    TopOfBook top = book.top_of_book(1);
+    {
+        BookCompactor<OrderBook<>> compactor(book, std::chrono::milliseconds(1));
+        compactor.start();
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (compactor.bytes_released() == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        compactor.stop();
+        self_check(compactor.bytes_released() > 0, "compaction releases the burst's memory");
+    }
+    book.depth_snapshot(1, 100, bids_after, asks_after);
+    auto same_depth = [](const std::vector<PriceLevel>& a, const std::vector<PriceLevel>& b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const PriceLevel& x, const PriceLevel& y) {
+            return x.price == y.price && x.quantity == y.quantity && x.order_count == y.order_count;
+        });
+    };
+    TopOfBook top_after = book.top_of_book(1);
+    self_check(same_depth(bids, bids_after) && same_depth(asks, asks_after) && top_after.bid_price == top.bid_price
+                   && top_after.bid_size == top.bid_size && top_after.ask_price == top.ask_price,
+               "compaction keeps every level");
+
+    self_check(book.cancel_order(buys[0]) && book.top_of_book(1).bid_size == top.bid_size - 10,
+               "a relocated order cancels");
+    self_check(book.modify_order(sells[0], 4, 102 * price_scale), "a relocated order is reduced in place");
+    self_check(book.modify_order(sells[1], 10, 103 * price_scale), "a relocated order is repriced");
+    std::vector<Execution> fills;
+    std::vector<Order> crossing{Order(Side::Buy, 1, 6, 102 * price_scale, 0)};
+    uint64_t new_id = 0;
+    book.add_orders(crossing, fills, &new_id);
+    self_check(fills.size() == 2 && fills[0].sell_order_id == sells[0] && fills[0].quantity == 4
+                   && fills[1].sell_order_id == sells[2] && fills[1].quantity == 2,
+               "a reduced relocated order keeps its time priority");
+    self_check(new_id > std::max(buys.back(), sells.back()), "order IDs continue after compaction");
+    std::printf("book compaction: ok\n");
+}
+
+/*
+ * OrderIndex past 2^32 IDs and with slot collisions: a live order keeps its slot, a
+ * later order on the same slot goes to the overflow, and both stay findable, also
+ * once the overflow outgrows its first table.
+ */
+void test_order_index_wrapping() {
+    OrderIndex index;
+    Node first(Order(Side::Buy, 1, 10, 100, 0));
+    Node second(Order(Side::Sell, 2, 10, 100, 0));
+    Node moved(Order(Side::Sell, 2, 10, 100, 0));
+    uint64_t old_id = (uint64_t(1) << 32) + 5;
+    uint64_t new_id = old_id + STOCK_ENGINE_ORDER_INDEX_SLOTS;
+    index.publish(old_id, 1, &first);
+    index.publish(new_id, 2, &second);
+    self_check(index.overflow_size() == 1, "colliding order goes to the overflow");
+    self_check(index.ticker_of(old_id) == 1 && index.node_of(old_id, 1) == &first, "order past 2^32 is found");
+    self_check(index.ticker_of(new_id) == 2 && index.node_of(new_id, 2) == &second, "overflowed order is found");
+    self_check(index.node_of(new_id, 1) == nullptr, "node_of checks the ticker");
+    index.publish(new_id, 2, &moved);
+    self_check(index.node_of(new_id, 2) == &moved, "overflowed order can move");
+    index.clear(new_id);
+    self_check(index.overflow_size() == 0 && index.ticker_of(new_id) == -1, "overflowed order is cleared");
+    index.clear(old_id);
+    self_check(index.ticker_of(old_id) == -1, "slot is freed");
+    index.publish(new_id, 2, &second);
+    self_check(index.overflow_size() == 0 && index.node_of(new_id, 2) == &second, "freed slot is reused");
+
+    // Enough spills on one slot to fill the first overflow table and chain another.
+    std::vector<uint64_t> spilled;
+    for (uint64_t k = 1; k <= 3000; k++) {
+        spilled.push_back(new_id + k * STOCK_ENGINE_ORDER_INDEX_SLOTS);
+        index.publish(spilled.back(), static_cast<int32_t>(k % 7), &first);
+    }
+    bool all_found = index.overflow_size() == spilled.size();
+    for (size_t k = 0; k < spilled.size(); k++) {
+        all_found = all_found && index.ticker_of(spilled[k]) == static_cast<int32_t>((k + 1) % 7)
+            && index.node_of(spilled[k], static_cast<int32_t>((k + 1) % 7)) == &first;
+    }
+    self_check(all_found, "a large overflow keeps every order findable");
+    for (size_t k = 0; k < spilled.size(); k += 2) {
+        index.clear(spilled[k]);
+    }
+    bool halves = index.overflow_size() == spilled.size() / 2;
+    for (size_t k = 0; k < spilled.size(); k++) {
+        halves = halves && (index.ticker_of(spilled[k]) == -1) == (k % 2 == 0);
+    }
+    self_check(halves, "clearing overflowed orders leaves the rest findable");
+    for (size_t k = 0; k < spilled.size(); k += 2) {
+        index.publish(spilled[k], 6, &moved);
+    }
+    self_check(index.overflow_size() == spilled.size() && index.node_of(spilled[0], 6) == &moved,
+               "cleared overflow entries are reused");
+    for (uint64_t id : spilled) {
+        index.clear(id);
+    }
+    self_check(index.overflow_size() == 0 && index.ticker_of(spilled.back()) == -1, "the overflow drains");
+    size_t bytes = index.bytes();
+    for (uint64_t id = 0; id < 4 * STOCK_ENGINE_ORDER_INDEX_SLOTS; id += 977) {
+        index.publish(id, 3, &first);
+        index.clear(id);
+    }
+    self_check(index.bytes() <= bytes + STOCK_ENGINE_ORDER_INDEX_SLOTS * 32, "memory is bounded by the slot count");
+    std::printf("order index wrapping: ok\n");
+}
+
+/*
+ * IOC, FOK and market orders: a FOK that cannot fill leaves the book untouched, a FOK
+ * that needs every crossing share fills, an IOC drops its remainder, and a market order
+ * on an empty side does nothing.
+ */
+template <typename Book>
+void test_order_types(const char* name) {
+    Book book;
+    OrderAck ack;
+    uint64_t next_id = 1;
+    auto submit = [&book, &ack, &next_id](Side side, uint32_t quantity, Price price, OrderType type) {
+        book.submit_order(Order(side, 1, quantity, price, next_id++, type), ack);
+    };
+    auto same_depth = [](const std::vector<PriceLevel>& a, const std::vector<PriceLevel>& b) {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const PriceLevel& x, const PriceLevel& y) {
+            return x.price == y.price && x.quantity == y.quantity && x.order_count == y.order_count;
+        });
+    };
+    const Price price = 100 * price_scale;
+    std::vector<PriceLevel> bids, asks, bids_after, asks_after;
+
+    submit(Side::Sell, 5, price + 1, OrderType::Limit);
+    submit(Side::Sell, 5, price + 2, OrderType::Limit);
+    book.depth_snapshot(1, 10, bids, asks);
+    submit(Side::Buy, 11, price + 2, OrderType::FillOrKill);
+    self_check(ack.status == OrderStatus::Cancelled && ack.filled_quantity == 0 && ack.fills.empty(),
+               "a FOK larger than the crossing depth is killed");
+    submit(Side::Buy, 10, price + 1, OrderType::FillOrKill);
+    self_check(ack.status == OrderStatus::Cancelled && ack.fills.empty(), "a FOK only counts levels inside its limit");
+    book.depth_snapshot(1, 10, bids_after, asks_after);
+    self_check(same_depth(bids, bids_after) && same_depth(asks, asks_after), "a killed FOK leaves the book unchanged");
+
+    submit(Side::Buy, 10, price + 2, OrderType::FillOrKill);
+    self_check(ack.status == OrderStatus::Filled && ack.filled_quantity == 10 && ack.fills.size() == 2
+               && ack.fills[0].price == price + 1 && ack.fills[1].price == price + 2,
+               "a FOK matching the crossing depth exactly fills");
+    self_check(book.top_of_book(1).ask_size == 0, "the exact FOK takes every crossing share");
+
+    submit(Side::Sell, 5, price + 1, OrderType::Limit);
+    submit(Side::Buy, 8, price + 1, OrderType::ImmediateOrCancel);
+    TopOfBook top = book.top_of_book(1);
+    self_check(ack.status == OrderStatus::Cancelled && ack.filled_quantity == 5 && ack.resting_quantity == 0,
+               "an IOC fills what crosses");
+    self_check(top.bid_size == 0 && top.ask_size == 0, "an IOC remainder does not rest");
+
+    submit(Side::Buy, 5, 0, OrderType::Market);
+    top = book.top_of_book(1);
+    self_check(ack.status == OrderStatus::Cancelled && ack.filled_quantity == 0 && ack.fills.empty(),
+               "a market order on an empty side does not fill");
+    self_check(top.bid_size == 0 && top.ask_size == 0, "a market order never rests");
+
+    submit(Side::Buy, 3, price - 1, OrderType::Limit);
+    submit(Side::Sell, 5, 0, OrderType::Market);
+    self_check(ack.status == OrderStatus::Cancelled && ack.filled_quantity == 3 && ack.fills.size() == 1
+               && ack.fills[0].price == price - 1 && book.top_of_book(1).ask_size == 0,
+               "a market order sweeps the opposite side and drops the rest");
+    std::printf("order types (%s): ok\n", name);
+}
+
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+/*
+ * Fills are journalled on the matching path: after an order crosses, last_appended()
+ * is its fill, and the journal holds the resting order, the crossing order and the
+ * fill in that order.
+ */
+void test_journal_fill_order() {
+    char directory[] = "/tmp/stock-engine-journal-XXXXXX";
+    if (!::mkdtemp(directory)) {
+        throw std::runtime_error("self-test cannot create a journal directory");
+    }
+    Journal::Config config;
+    config.directory = directory;
+    config.segment_bytes = size_t(1) << 16;
+    config.direct_io = false;
+    std::vector<JournalEntry> entries;
+    uint64_t resting_id = 0;
+    uint64_t crossing_id = 0;
+    uint64_t last = 0;
+    {
+        Journal journal(config);
+        OrderBook<> book;
+        book.set_order_log(&journal);
+        resting_id = book.add_order(Side::Sell, 7, 10, 100 * price_scale);
+        crossing_id = book.add_order(Side::Buy, 7, 4, 100 * price_scale);
+        last = journal.last_appended();
+        journal.wait_durable(last);
+        journal.close();
+    }
+    bool refused_reuse = false;
+    try {
+        Journal again(config);
+    } catch (const std::runtime_error&) {
+        refused_reuse = true;
+    }
+    std::string path = std::string(directory) + "/journal-000000.log";
+    if (FILE* file = std::fopen(path.c_str(), "rb")) {
+        JournalEntry entry;
+        while (std::fread(&entry, sizeof(entry), 1, file) == 1 && entry.type != JournalEntryType::Invalid) {
+            entries.push_back(entry);
+        }
+        std::fclose(file);
+    }
+    ::unlink(path.c_str());
+    ::rmdir(directory);
+    self_check(entries.size() == 3 && last == 3, "journal holds two orders and one fill");
+    self_check(entries[0].type == JournalEntryType::Order && entries[0].order.order_id == resting_id
+               && entries[1].type == JournalEntryType::Order && entries[1].order.order_id == crossing_id,
+               "orders are journalled in the order they were applied");
+    self_check(entries[2].type == JournalEntryType::Fill && entries[2].sequence == last
+               && entries[2].fill.buy_order_id == crossing_id && entries[2].fill.sell_order_id == resting_id
+               && entries[2].fill.quantity == 4,
+               "a fill follows its order and last_appended() covers it");
+    self_check(refused_reuse, "a second journal refuses a directory that already holds one");
+    std::printf("journal fill order: ok\n");
+}
+
+/*
+ * Journal writes that fail part-way through a segment (RLIMIT_FSIZE makes pwrite
+ * return EFBIG): the long group-commit delay forces commits from a full buffer, the
+ * writer must stop there, and every durable entry must be on disk in order.
+ */
+void test_journal_write_failure() {
+    char directory[] = "/tmp/stock-engine-journal-XXXXXX";
+    if (!::mkdtemp(directory)) {
+        throw std::runtime_error("self-test cannot create a journal directory");
+    }
+    Journal::Config config;
+    config.directory = directory;
+    config.segment_bytes = size_t(1) << 16;
+    config.group_commit_bytes = 4096;
+    config.group_commit_micros = 10000000;
+    config.direct_io = false;
+    rlimit saved;
+    ::getrlimit(RLIMIT_FSIZE, &saved);
+    auto previous = std::signal(SIGXFSZ, SIG_IGN);
+    uint64_t last = 0;
+    uint64_t durable = 0;
+    int error = 0;
+    bool wait_threw = false;
+    {
+        Journal journal(config);
+        rlimit limit = saved;
+        limit.rlim_cur = 16384;
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        for (uint64_t id = 0; id < 4000; id++) {
+            try {
+                last = journal.append_order(OrderLogType::Add, Order(Side::Buy, 1, 1, 100, id));
+            } catch (const std::runtime_error&) {
+                break;
+            }
+        }
+        try {
+            journal.wait_durable(last);
+        } catch (const std::runtime_error&) {
+            wait_threw = true;
+        }
+        journal.close();
+        error = journal.error();
+        durable = journal.durable_sequence();
+    }
+    ::setrlimit(RLIMIT_FSIZE, &saved);
+    std::signal(SIGXFSZ, previous);
+
+    std::string first = std::string(directory) + "/journal-000000.log";
+    std::string second = std::string(directory) + "/journal-000001.log";
+    // Count the leading entries in sequence; the write that failed may have torn the next one.
+    uint64_t on_disk = 0;
+    if (FILE* file = std::fopen(first.c_str(), "rb")) {
+        JournalEntry entry;
+        while (std::fread(&entry, sizeof(entry), 1, file) == 1 && entry.type == JournalEntryType::Order
+               && entry.sequence == on_disk + 1 && entry.order.order_id == on_disk) {
+            on_disk++;
+        }
+        std::fclose(file);
+    }
+    bool rolled_over = ::access(second.c_str(), F_OK) == 0;
+    ::unlink(first.c_str());
+    ::unlink(second.c_str());
+    ::rmdir(directory);
+    self_check(error == EFBIG && wait_threw, "journal reports the failed write");
+    self_check(durable > 0 && durable < last, "durable sequence stops at the failure");
+    self_check(on_disk >= durable, "every durable entry is on disk in order");
+    self_check(!rolled_over, "journal does not roll over after a failed commit");
+    std::printf("journal write failure: ok\n");
+}
+#endif
+
+/*
+ * Snapshot in the middle of a random flow, record the rest of the flow, then restore
+ * the snapshot and replay the recording: the replay must make the same fills. Restoring
+ * into a book that has resting orders or reserved IDs must throw.
+ */
+void test_snapshot_round_trip() {
+    char directory[] = "/tmp/stock-engine-snapshot-XXXXXX";
+    if (!::mkdtemp(directory)) {
+        throw std::runtime_error("self-test cannot create a snapshot directory");
+    }
+    std::string snapshot_path = std::string(directory) + "/book.snap";
+    std::string log_path = std::string(directory) + "/flow.log";
+    FillDigest live;
+    uint64_t highest_id = 0;
+    uint64_t snapshot_id = 0;
+    {
+        ExecutionReporter reporter;
+        reporter.add_listener(&live);
+        reporter.start();
+        OrderBook<NullLock> book;
+        std::mt19937 gen(1515);
+        std::vector<uint64_t> ids;
+        auto flow = [&book, &gen, &ids, &highest_id](int operations) {
+            for (int i = 0; i < operations; i++) {
+                uint32_t choice = gen() % 10;
+                if (choice < 7 || ids.empty()) {
+                    Side side = (gen() & 1) ? Side::Buy : Side::Sell;
+                    Price price = (100 + static_cast<Price>(gen() % 20) - 10) * price_scale;
+                    ids.push_back(book.add_order(side, static_cast<int32_t>(gen() % 8), 1 + gen() % 50, price));
+                    highest_id = std::max(highest_id, ids.back());
+                } else if (choice < 9) {
+                    book.cancel_order(ids[gen() % ids.size()]);
+                } else {
+                    Price price = (100 + static_cast<Price>(gen() % 20) - 10) * price_scale;
+                    book.modify_order(ids[gen() % ids.size()], gen() % 40, price);
+                }
+            }
+        };
+        flow(3000);
+        book.snapshot(snapshot_path);
+        snapshot_id = highest_id;
+        OrderLogWriter log(log_path);
+        book.set_order_log(&log);
+        book.set_execution_reporter(&reporter);
+        flow(6000);
+        log.close();
+        reporter.stop();
+    }
+    ReplayResult replayed = replay_order_log(log_path, "", snapshot_path);
+
+    bool refused_resting = false;
+    bool refused_reserved = false;
+    OrderBook<> resting;
+    resting.add_order(Side::Buy, 1, 10, 100 * price_scale);
+    try {
+        resting.restore(snapshot_path);
+    } catch (const std::logic_error&) {
+        refused_resting = true;
+    }
+    OrderBook<> reserved;
+    reserved.cancel_order(reserved.add_order(Side::Buy, 1, 10, 100 * price_scale));
+    try {
+        reserved.restore(snapshot_path);
+    } catch (const std::logic_error&) {
+        refused_reserved = true;
+    }
+    OrderBook<> fresh;
+    fresh.restore(snapshot_path);
+    uint64_t next_id = fresh.add_order(Side::Buy, 1, 1, 1);
+    ::unlink(snapshot_path.c_str());
+    ::unlink(log_path.c_str());
+    ::rmdir(directory);
+
+    self_check(live.fills > 0 && replayed.fills == live.fills && replayed.fill_digest == live.digest,
+               "replaying a recording over its snapshot makes the same fills");
+    self_check(refused_resting, "restore refuses a book with resting orders");
+    self_check(refused_reserved, "restore refuses a book that reserved order IDs");
+    self_check(next_id > snapshot_id, "a restored book resumes IDs after the snapshot");
+    std::printf("snapshot round trip: ok\n");
+}
+
+/*
+ * A snapshot whose order records disagree with the section they sit in (a buy
+ * filed among the sells, or another ticker's order) is refused on restore.
+ */
+void test_snapshot_corruption() {
+    char directory[] = "/tmp/stock-engine-snapshot-XXXXXX";
+    if (!::mkdtemp(directory)) {
+        throw std::runtime_error("self-test cannot create a snapshot directory");
+    }
+    std::string snapshot_path = std::string(directory) + "/book.snap";
+    {
+        OrderBook<NullLock> book;
+        book.add_order(Side::Buy, 3, 10, 99 * price_scale);
+        book.add_order(Side::Sell, 3, 10, 101 * price_scale);
+        book.snapshot(snapshot_path);
+    }
+    std::vector<char> bytes(sizeof(SnapshotHeader) + sizeof(SnapshotTickerHeader) + 2 * sizeof(Order));
+    {
+        std::unique_ptr<FILE, int (*)(FILE*)> in(std::fopen(snapshot_path.c_str(), "rb"), &std::fclose);
+        if (!in || std::fread(bytes.data(), 1, bytes.size(), in.get()) != bytes.size()) {
+            throw std::runtime_error("self-test cannot read back its snapshot");
+        }
+    }
+    // Ticker 3 is the only slot, so its first record (the buy) follows the two headers.
+    size_t first_order = sizeof(SnapshotHeader) + sizeof(SnapshotTickerHeader);
+    auto restore_with = [&](size_t offset, const void* value, size_t size) {
+        std::vector<char> patched = bytes;
+        std::memcpy(patched.data() + first_order + offset, value, size);
+        {
+            std::unique_ptr<FILE, int (*)(FILE*)> out(std::fopen(snapshot_path.c_str(), "wb"), &std::fclose);
+            if (!out || std::fwrite(patched.data(), 1, patched.size(), out.get()) != patched.size()) {
+                throw std::logic_error("self-test cannot write a patched snapshot");
+            }
+        }
+        OrderBook<NullLock> fresh;
+        try {
+            fresh.restore(snapshot_path);
+        } catch (const std::runtime_error&) {
+            return false;
+        }
+        return true;
+    };
+    Side sell = Side::Sell;
+    int32_t other_ticker = 4;
+    int32_t same_ticker = 3;
+    bool wrong_side = restore_with(offsetof(Order, side), &sell, sizeof(sell));
+    bool wrong_ticker = restore_with(offsetof(Order, ticker), &other_ticker, sizeof(other_ticker));
+    bool untouched = restore_with(offsetof(Order, ticker), &same_ticker, sizeof(same_ticker));
+    ::unlink(snapshot_path.c_str());
+    ::rmdir(directory);
+
+    self_check(!wrong_side, "restore refuses an order filed under the wrong side");
+    self_check(!wrong_ticker, "restore refuses an order filed under another ticker");
+    self_check(untouched, "restore accepts the unmodified snapshot");
+    std::printf("snapshot corruption: ok\n");
+}
+
+#ifdef __linux__
+/*
+ * An order capture on a full disk (/dev/full fails every write with ENOSPC): the
+ * writer records the error, and the book then refuses orders it cannot capture.
+ */
+void test_order_log_write_failure() {
+    OrderLogWriter log("/dev/full");
+    OrderBook<NullLock> book;
+    book.set_order_log(&log);
+    bool refused = false;
+    for (int i = 0; i < 1000000 && !refused; i++) {
+        try {
+            book.add_order(Side::Buy, i % 8, 1, (100 - i % 50) * price_scale);
+        } catch (const std::runtime_error&) {
+            refused = true;
+        }
+        if (i % 1024 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    log.close();
+    self_check(refused, "a book refuses orders its failed capture cannot record");
+    self_check(log.failed() && log.error() == ENOSPC, "the capture reports the failed write");
+    std::printf("order log write failure: ok\n");
+}
+
+/*
+ * Replaying with --fills onto a full disk: replay throws rather than reporting
+ * success over a truncated fills file.
+ */
+void test_fill_output_failure() {
+    char directory[] = "/tmp/stock-engine-fills-XXXXXX";
+    if (!::mkdtemp(directory)) {
+        throw std::runtime_error("self-test cannot create a log directory");
+    }
+    std::string log_path = std::string(directory) + "/flow.log";
+    {
+        OrderLogWriter log(log_path);
+        OrderBook<NullLock> book;
+        book.set_order_log(&log);
+        for (int i = 0; i < 4096; i++) {
+            book.add_order(Side::Sell, i % 8, 1, 100 * price_scale);
+            book.add_order(Side::Buy, i % 8, 1, 100 * price_scale);
+        }
+        log.close();
+    }
+    bool refused = false;
+    try {
+        replay_order_log(log_path, "/dev/full");
+    } catch (const std::runtime_error&) {
+        refused = true;
+    }
+    ReplayResult replayed = replay_order_log(log_path);
+    ::unlink(log_path.c_str());
+    ::rmdir(directory);
+    self_check(replayed.fills == 4096, "the recording replays its fills");
+    self_check(refused, "a replay whose fill output fails throws");
+    std::printf("fill output failure: ok\n");
+}
+
+/*
+ * A snapshot on a full disk (/dev/full fails every write with ENOSPC) throws
+ * instead of leaving a silently truncated file.
+ */
+void test_snapshot_write_failure() {
+    OrderBook<NullLock> book;
+    for (int i = 0; i < 4096; i++) {
+        book.add_order(Side::Buy, i % 8, 1, (100 - i % 50) * price_scale);
+    }
+    bool refused = false;
+    try {
+        book.snapshot("/dev/full");
+    } catch (const std::runtime_error&) {
+        refused = true;
+    }
+    self_check(refused, "a snapshot that cannot be written throws");
+    std::printf("snapshot write failure: ok\n");
+}
+#endif
+
+#ifdef STOCK_ENGINE_HAS_RECVMMSG
+/*
+ * A gateway whose window is narrower than one datagram: the client sends shorter
+ * datagrams instead of waiting for credit that can never arrive, and every order
+ * gets through in sequence. A zero window is refused.
+ */
+void test_gateway_narrow_window() {
+    OrderBook<NullLock> book;
+    OrderGateway<OrderBook<NullLock>>::Config config;
+    config.loopback_only = true;
+    config.window = 10;
+    OrderGateway<OrderBook<NullLock>> gateway(book, config);
+    gateway.start();
+    {
+        GatewayClient client("127.0.0.1", gateway.port(), 0, config.window);
+        Order batch[gateway_max_orders];
+        for (int round = 0; round < 8; round++) {
+            for (size_t i = 0; i < gateway_max_orders; i++) {
+                batch[i] = Order(Side::Buy, static_cast<int>(i % 4), 1, (90 - round) * price_scale, 0);
+            }
+            client.send(batch, gateway_max_orders);
+        }
+        client.flush();
+        self_check(client.acknowledged() == 8 * gateway_max_orders, "a narrow window acknowledges every order");
+    }
+    gateway.stop();
+    self_check(gateway.stats().orders.load() == 8 * gateway_max_orders, "a narrow window applies every order");
+
+    bool refused = false;
+    config.window = 0;
+    try {
+        OrderGateway<OrderBook<NullLock>> closed(book, config);
+    } catch (const std::invalid_argument&) {
+        refused = true;
+    }
+    self_check(refused, "a gateway refuses a zero window");
+    std::printf("gateway narrow window: ok\n");
+}
+
+/*
+ * A stray datagram naming a live session with a stale sequence, sent from another
+ * address: it is counted as a duplicate, its sender gets no ack, and the session's
+ * own client keeps receiving acks.
+ */
+void test_gateway_stray_datagram() {
+    OrderBook<NullLock> book;
+    OrderGateway<OrderBook<NullLock>>::Config config;
+    config.loopback_only = true;
+    OrderGateway<OrderBook<NullLock>> gateway(book, config);
+    gateway.start();
+    GatewayClient client("127.0.0.1", gateway.port(), 0);
+    Order batch[4];
+    for (int i = 0; i < 4; i++) {
+        batch[i] = Order(Side::Buy, i, 1, 90 * price_scale, 0);
+    }
+    client.send(batch, 4);
+    client.flush();
+    uint64_t duplicates = gateway.stats().duplicates.load();
+
+    int stray = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (stray < 0) {
+        throw std::runtime_error("self-test cannot create a stray socket");
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(gateway.port());
+    ::inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    unsigned char datagram[sizeof(GatewayHeader) + sizeof(Order)];
+    GatewayHeader header{gateway_magic, gateway_version, 1, 0, 0, 0};
+    std::memcpy(datagram, &header, sizeof(header));
+    std::memcpy(datagram + sizeof(header), &batch[0], sizeof(Order));
+    bool stray_acked = false;
+    if (::connect(stray, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0
+        && ::send(stray, datagram, sizeof(datagram), 0) == static_cast<ssize_t>(sizeof(datagram))) {
+        pollfd ready{stray, POLLIN, 0};
+        stray_acked = poll(&ready, 1, 100) > 0;
+    }
+    ::close(stray);
+
+    client.send(batch, 4);
+    client.flush();
+    gateway.stop();
+    self_check(gateway.stats().duplicates.load() > duplicates, "the stray datagram is counted as a duplicate");
+    self_check(!stray_acked, "a stale datagram does not redirect its session's acks");
+    self_check(client.acknowledged() == 8 && gateway.stats().orders.load() == 8,
+               "the session's client keeps its acks after a stray datagram");
+    std::printf("gateway stray datagram: ok\n");
+}
+
+/*
+ * A sender that ignores its credit: an in-sequence datagram reaching past the
+ * window is dropped and counted, and one inside the window is still applied.
+ */
+void test_gateway_window_enforced() {
+    OrderBook<NullLock> book;
+    OrderGateway<OrderBook<NullLock>>::Config config;
+    config.loopback_only = true;
+    config.window = 10;
+    OrderGateway<OrderBook<NullLock>> gateway(book, config);
+    gateway.start();
+    int sender = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (sender < 0) {
+        throw std::runtime_error("self-test cannot create a sender socket");
+    }
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(gateway.port());
+    ::inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (::connect(sender, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        ::close(sender);
+        throw std::runtime_error("self-test cannot connect its sender");
+    }
+    GatewayAck ack{};
+    auto send_and_wait = [&](uint16_t count) {
+        unsigned char datagram[sizeof(GatewayHeader) + 20 * sizeof(Order)];
+        GatewayHeader header{gateway_magic, gateway_version, count, 0, 0, 0};
+        std::memcpy(datagram, &header, sizeof(header));
+        for (uint16_t i = 0; i < count; i++) {
+            Order order(Side::Buy, 1, 1, 90 * price_scale, 0);
+            std::memcpy(datagram + sizeof(header) + i * sizeof(Order), &order, sizeof(order));
+        }
+        size_t length = sizeof(header) + count * sizeof(Order);
+        pollfd ready{sender, POLLIN, 0};
+        return ::send(sender, datagram, length, 0) == static_cast<ssize_t>(length) && poll(&ready, 1, 1000) > 0
+            && ::recv(sender, &ack, sizeof(ack), 0) == static_cast<ssize_t>(sizeof(ack));
+    };
+    bool over_acked = send_and_wait(20);
+    uint64_t after_over = ack.next_sequence;
+    bool inside_acked = send_and_wait(10);
+    uint64_t after_inside = ack.next_sequence;
+    ::close(sender);
+    gateway.stop();
+    self_check(over_acked && after_over == 0 && gateway.stats().over_window.load() == 1,
+               "a datagram past the window is dropped and asked for again");
+    self_check(inside_acked && after_inside == 10 && gateway.stats().orders.load() == 10,
+               "a datagram inside the window is applied");
+    std::printf("gateway window enforced: ok\n");
+}
+#endif
+
+/*
+ * Cancel and modify on one ticker: cancels of resting, unknown and already cancelled
+ * orders, an in-place reduce that keeps time priority, a quantity increase and a
+ * reprice that both requeue, a reprice that crosses, a zero-quantity modify, and a
+ * side's only order repriced outside the ladder band.
+ */
+template <typename Book>
+void test_cancel_and_modify(const char* name) {
+    Book book;
+    std::vector<Execution> fills;
+    auto add = [&book, &fills](Side side, uint32_t quantity, Price price) {
+        Order order(side, 1, quantity, price, 0);
+        uint64_t order_id = 0;
+        book.add_orders(&order, 1, fills, &order_id);
+        return order_id;
+    };
+    const Price price = 100 * price_scale;
+
+    uint64_t first = add(Side::Buy, 10, price);
+    self_check(book.cancel_order(first), "cancel a resting order");
+    self_check(!book.cancel_order(first), "cancel an order twice");
+    self_check(!book.cancel_order(first + 1000), "cancel an unknown order");
+    self_check(book.top_of_book(1).bid_size == 0, "cancel empties the level");
+
+    uint64_t front = add(Side::Buy, 10, price);
+    uint64_t back = add(Side::Buy, 10, price);
+    self_check(book.modify_order(front, 4, price), "reduce in place");
+    self_check(book.top_of_book(1).bid_size == 14, "reduce updates the level quantity");
+    fills.clear();
+    add(Side::Sell, 4, price);
+    self_check(fills.size() == 1 && fills[0].buy_order_id == front && fills[0].quantity == 4,
+               "a reduced order keeps its time priority");
+
+    self_check(book.modify_order(back, 20, price), "increase quantity");
+    uint64_t middle = add(Side::Buy, 5, price);
+    uint64_t better = add(Side::Buy, 5, price + 1);
+    self_check(book.modify_order(better, 5, price), "reprice to a worse level");
+    fills.clear();
+    add(Side::Sell, 30, price);
+    self_check(fills.size() == 3 && fills[0].buy_order_id == back && fills[0].quantity == 20
+               && fills[1].buy_order_id == middle && fills[2].buy_order_id == better,
+               "an increased or repriced order goes behind the orders already at its level");
+
+    uint64_t resting = add(Side::Buy, 10, price);
+    uint64_t ask = add(Side::Sell, 6, price + 2);
+    fills.clear();
+    self_check(book.modify_order(resting, 10, price + 2), "reprice through the spread");
+    TopOfBook top = book.top_of_book(1);
+    self_check(top.bid_price == price + 2 && top.bid_size == 4 && top.ask_size == 0,
+               "a repriced order that crosses matches and rests the remainder");
+    self_check(!book.cancel_order(ask), "a filled order is no longer resting");
+
+    self_check(book.modify_order(resting, 0, price + 2), "zero-quantity modify");
+    self_check(book.top_of_book(1).bid_size == 0, "zero-quantity modify cancels");
+    self_check(!book.cancel_order(resting) && !book.modify_order(resting, 5, price),
+               "a cancelled order cannot be cancelled or modified again");
+
+    // The only order on its side may move anywhere: once removed, the ladder re-anchors on it.
+    Price far = price + 10 * static_cast<Price>(STOCK_ENGINE_LADDER_TICKS);
+    uint64_t lone = book.add_order(Side::Sell, 2, 5, price);
+    self_check(book.modify_order(lone, 5, far) && book.top_of_book(2).ask_price == far,
+               "a side's only order can be repriced outside the current band");
+    self_check(book.cancel_order(lone) && book.top_of_book(2).ask_size == 0, "the far repriced order cancels");
+    std::printf("cancel and modify (%s): ok\n", name);
+}
+
+/*
+ * Incremental depth against the book: a random flow of adds, crossing orders (partial
+ * fills), cancels, in-place reduces and reprices on a few tickers. Each ticker's
+ * updates are numbered without gaps, and applying the ones after a mid-flow
+ * depth_snapshot to that snapshot reproduces the final book level for level.
+ */
+template <typename Book>
+void test_depth_feed(const char* name) {
+    constexpr int tickers = 3;
+    Book book;
+    DepthFeed feed;
+    book.set_depth_feed(&feed);
+    std::vector<DepthUpdate> updates;
+    auto drain = [&feed, &updates]() {
+        DepthUpdate batch[256];
+        while (size_t count = feed.poll(batch, 256)) {
+            updates.insert(updates.end(), batch, batch + count);
+        }
+    };
+    std::mt19937 gen(1818);
+    std::vector<std::pair<uint64_t, Price>> ids;
+    auto flow = [&](int operations) {
+        for (int i = 0; i < operations; i++) {
+            uint32_t choice = gen() % 10;
+            Price price = 100 * price_scale + static_cast<Price>(gen() % 21) - 10;
+            if (choice < 6 || ids.empty()) {
+                Side side = (gen() & 1) ? Side::Buy : Side::Sell;
+                ids.emplace_back(book.add_order(side, static_cast<int32_t>(gen() % tickers), 1 + gen() % 30, price),
+                                 price);
+            } else {
+                auto& picked = ids[gen() % ids.size()];
+                if (choice < 8) {
+                    book.cancel_order(picked.first);
+                } else if (choice < 9) {
+                    book.modify_order(picked.first, 1, picked.second);
+                } else {
+                    book.modify_order(picked.first, 1 + gen() % 30, price);
+                    picked.second = price;
+                }
+            }
+            drain();
+        }
+    };
+
+    using Levels = std::map<std::pair<int, Price>, std::pair<uint64_t, uint32_t>>;
+    auto load = [&book](int ticker, Levels& levels) {
+        std::vector<PriceLevel> bids, asks;
+        uint64_t sequence = book.depth_snapshot(ticker, size_t(1) << 20, bids, asks);
+        levels.clear();
+        for (const PriceLevel& level : bids) {
+            levels[{0, level.price}] = {level.quantity, level.order_count};
+        }
+        for (const PriceLevel& level : asks) {
+            levels[{1, level.price}] = {level.quantity, level.order_count};
+        }
+        return sequence;
+    };
+
+    flow(2000);
+    Levels rebuilt[tickers];
+    uint64_t start[tickers];
+    for (int t = 0; t < tickers; t++) {
+        start[t] = load(t, rebuilt[t]);
+    }
+    flow(4000);
+
+    uint64_t last[tickers] = {};
+    bool sequenced = true;
+    bool consistent = true;
+    for (const DepthUpdate& update : updates) {
+        int t = update.ticker;
+        sequenced = sequenced && update.sequence == last[t] + 1;
+        last[t] = update.sequence;
+        if (update.sequence <= start[t]) {
+            continue;
+        }
+        std::pair<int, Price> key{update.side == Side::Buy ? 0 : 1, update.price};
+        bool known = rebuilt[t].count(key) > 0;
+        if (update.action == DepthAction::Delete) {
+            consistent = consistent && known;
+            rebuilt[t].erase(key);
+        } else {
+            consistent = consistent && known == (update.action == DepthAction::Change) && update.quantity > 0;
+            rebuilt[t][key] = {update.quantity, update.order_count};
+        }
+    }
+    bool reproduced = true;
+    for (int t = 0; t < tickers; t++) {
+        Levels final_levels;
+        reproduced = reproduced && load(t, final_levels) == last[t] && final_levels == rebuilt[t];
+    }
+    self_check(sequenced, "depth sequences have no gaps per ticker");
+    self_check(consistent, "adds open new levels and changes and deletes touch existing ones");
+    self_check(reproduced, "a snapshot plus later updates reproduces the book");
+    std::printf("depth feed (%s): ok\n", name);
+}
+
+/*
+ * Clearing price against a brute-force scan of every tick: most volume, least surplus,
+ * then the buy/sell pressure and midpoint tie-breaks over the tied ticks. Random books
+ * use sparse price grids so the best tick often has no resting orders.
+ */
+template <typename Book>
+void test_auction_clearing_price(const char* name) {
+    std::mt19937 gen(2410);
+    constexpr int rounds = 3000;
+    for (int round = 0; round < rounds; round++) {
+        Book book;
+        book.begin_auction(1);
+        std::vector<Order> placed;
+        Price base = 1000;
+        Price spacing = 1 + round % 5;
+        int count = 1 + static_cast<int>(gen() % 30);
+        for (int i = 0; i < count; i++) {
+            Side side = (gen() & 1) ? Side::Buy : Side::Sell;
+            Price price = base + static_cast<Price>(gen() % 12) * spacing;
+            uint32_t quantity = 1 + static_cast<uint32_t>(gen() % (round % 2 ? 5 : 50));
+            book.add_order(side, 1, quantity, price);
+            placed.push_back(Order(side, 1, quantity, price, 0));
+        }
+        auto interest = [&placed](Price price, uint64_t& demand, uint64_t& supply) {
+            demand = supply = 0;
+            for (const Order& order : placed) {
+                if (order.side == Side::Buy && order.price >= price) {
+                    demand += order.quantity;
+                } else if (order.side == Side::Sell && order.price <= price) {
+                    supply += order.quantity;
+                }
+            }
+        };
+        uint64_t best_volume = 0, best_surplus = 0;
+        Price low = 0, high = 0;
+        for (Price price = base; price <= base + 11 * spacing; price++) {
+            uint64_t demand, supply;
+            interest(price, demand, supply);
+            uint64_t volume = std::min(demand, supply);
+            uint64_t surplus = demand > supply ? demand - supply : supply - demand;
+            if (volume > best_volume || (volume == best_volume && volume > 0 && surplus < best_surplus)) {
+                best_volume = volume;
+                best_surplus = surplus;
+                low = high = price;
+            } else if (volume == best_volume && volume > 0 && surplus == best_surplus) {
+                high = price;
+            }
+        }
+        uint64_t demand, supply;
+        Price expected = 0;
+        if (best_volume > 0) {
+            interest(high, demand, supply);
+            if (demand > supply) {
+                expected = high;
+            } else {
+                interest(low, demand, supply);
+                expected = supply > demand ? low : low + (high - low) / 2;
+            }
+        }
+
+        std::vector<Execution> fills;
+        AuctionResult result = book.uncross_auction(1, &fills);
+        self_check(result.volume == best_volume, "uncross executes the most volume any tick could");
+        self_check(best_volume == 0 || result.price == expected, "clearing price follows the tie-break rules");
+        interest(result.price, demand, supply);
+        self_check(best_volume == 0 || result.imbalance == static_cast<int64_t>(demand) - static_cast<int64_t>(supply),
+                   "imbalance is measured at the clearing price");
+        uint64_t executed = 0;
+        for (const Execution& fill : fills) {
+            self_check(fill.price == result.price, "every auction fill trades at the clearing price");
+            executed += fill.quantity;
+        }
+        self_check(executed == best_volume, "fills add up to the auction volume");
+        TopOfBook top = book.top_of_book(1);
+        self_check(top.bid_price == 0 || top.ask_price == 0 || top.bid_price < top.ask_price,
+                   "the book is uncrossed afterwards");
+    }
+    std::printf("auction clearing price (%s, %d books): ok\n", name, rounds);
+}
+
+int run_self_tests() {
+    try {
+        test_symbol_table_overflow();
+        test_sharded_rejections();
+        test_sharded_order_ids();
+        test_order_index_wrapping();
+        test_quote_seqlock();
+        test_combining_engine();
+        test_book_compaction();
+        test_snapshot_round_trip();
+        test_snapshot_corruption();
+#ifdef __linux__
+        test_order_log_write_failure();
+        test_snapshot_write_failure();
+        test_fill_output_failure();
+#endif
+#ifdef STOCK_ENGINE_HAS_RECVMMSG
+        test_gateway_narrow_window();
+        test_gateway_stray_datagram();
+        test_gateway_window_enforced();
+#endif
+        test_cancel_and_modify<OrderBook<NullLock>>("level book");
+        test_cancel_and_modify<LadderOrderBook<NullLock>>("ladder book");
+        test_order_types<OrderBook<NullLock>>("level book");
+        test_order_types<LadderOrderBook<NullLock>>("ladder book");
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+        test_journal_fill_order();
+        test_journal_write_failure();
+#endif
+        test_depth_feed<OrderBook<NullLock>>("level book");
+        test_depth_feed<LadderOrderBook<NullLock>>("ladder book");
+        test_auction_clearing_price<OrderBook<NullLock>>("level book");
+        test_auction_clearing_price<LadderOrderBook<NullLock>>("ladder book");
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    std::printf("all self-tests passed\n");
+    return 0;
+}
+
+/*
+ * Main function launches multiple threads to simulate live trading.
+ * - Each thread processes 500 random stock orders.
+ * - Ensures concurrent access and execution of trades.
+ * - --shards N routes the flow through a ShardedEngine with N matching threads,
+ *   optionally pinned with --cpus 0,1,2,3.
+ * - --record path captures the order stream to a binary log.
+ * - --snapshot path writes the final book state (non-sharded runs).
+ * - --journal dir journals every accepted order and fill with group commit.
+ * Pass --replay path [--fills out] [--restore snapshot] to replay a recorded log, --bench [options] to run the throughput/latency benchmark, or --lock-bench /
+ * --lock-policy-bench to run a lock microbenchmark instead.
+ * --auction-bench [tickers] [orders per ticker] [threads] compares a serial and a parallel auction uncross.
+ * --self-test runs the built-in regression checks.
+ * On Linux, --gateway port [seconds] serves the UDP wire protocol and --gateway-bench [clients] [orders]
+ * streams orders through it over loopback.
+ */
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--lock-bench") {
+        run_lock_layout_benchmark();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--lock-policy-bench") {
+        run_lock_policy_benchmark();
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--self-test") {
+        return run_self_tests();
+    }
+    if (argc > 1 && std::string(argv[1]) == "--auction-bench") {
+        int tickers = argc > 2 ? std::stoi(argv[2]) : 1024;
+        long orders = argc > 3 ? std::stol(argv[3]) : 1000;
+        int threads = argc > 4 ? std::stoi(argv[4]) : static_cast<int>(std::thread::hardware_concurrency());
+        try {
+            run_auction_benchmark(tickers, orders, threads);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+#ifdef STOCK_ENGINE_HAS_RECVMMSG
+    if (argc > 1 && std::string(argv[1]) == "--gateway-bench") {
+        int clients = argc > 2 ? std::stoi(argv[2]) : 4;
+        long orders = argc > 3 ? std::stol(argv[3]) : 200000;
+        try {
+            run_gateway_benchmark(clients, orders);
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 2 && std::string(argv[1]) == "--gateway") {
+        // Serve the wire protocol on the given UDP port for a number of seconds, printing fills.
+        int seconds = argc > 3 ? std::stoi(argv[3]) : 60;
+        TextExecutionPrinter printer;
+        ExecutionReporter reporter;
+        reporter.add_listener(&printer);
+        reporter.start();
+        order_book.set_execution_reporter(&reporter);
+        try {
+            OrderGateway<OrderBook<>>::Config config;
+            config.port = static_cast<uint16_t>(std::stoi(argv[2]));
+            OrderGateway<OrderBook<>> gateway(order_book, config);
+            gateway.start();
+            std::this_thread::sleep_for(std::chrono::seconds(seconds));
+            gateway.stop();
+            std::fprintf(stderr, "%llu orders from %llu datagrams (%llu malformed, %llu gaps, %llu over window)\n",
+                         static_cast<unsigned long long>(gateway.stats().orders.load()),
+                         static_cast<unsigned long long>(gateway.stats().datagrams.load()),
+                         static_cast<unsigned long long>(gateway.stats().malformed.load()),
+                         static_cast<unsigned long long>(gateway.stats().gaps.load()),
+                         static_cast<unsigned long long>(gateway.stats().over_window.load()));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            reporter.stop();
+            return 1;
+        }
+        reporter.stop();
+        return 0;
+    }
+#endif
+    if (argc > 2 && std::string(argv[1]) == "--replay") {
+        try {
+            std::string fills_path;
+            std::string snapshot_path;
+            for (int i = 3; i + 1 < argc; i += 2) {
+                std::string arg = argv[i];
+                if (arg == "--fills") {
+                    fills_path = argv[i + 1];
+                } else if (arg == "--restore") {
+                    snapshot_path = argv[i + 1];
+                } else {
+                    throw std::invalid_argument("unknown replay option: " + arg);
+                }
+            }
+            ReplayResult result = replay_order_log(argv[2], fills_path, snapshot_path);
+            std::printf("replayed %llu records in %.3f s (%.0f records/s), %llu fills, digest %016llx\n",
+                        static_cast<unsigned long long>(result.records), result.seconds,
+                        result.records / std::max(result.seconds, 1e-9),
+                        static_cast<unsigned long long>(result.fills),
+                        static_cast<unsigned long long>(result.fill_digest));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 1 && std::string(argv[1]) == "--bench") {
+        try {
+            run_benchmark(parse_benchmark_args(argc, argv, 2));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    ShardedEngine::Config shard_config;
+    bool sharded = false;
+    std::string record_path;
+    std::string snapshot_path;
+    std::string journal_dir;
+    bool metrics = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--shards" && i + 1 < argc) {
+            sharded = true;
+            shard_config.shard_count = std::stoi(argv[++i]);
+        } else if (arg == "--numa") {
+            shard_config.numa_spread = true;
+        } else if (arg == "--metrics") {
+            metrics = true;
+        } else if (arg == "--record" && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (arg == "--journal" && i + 1 < argc) {
+            journal_dir = argv[++i];
+        } else if (arg == "--cpus" && i + 1 < argc) {
+            // Comma-separated CPU list, one per shard.
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start < list.size()) {
+                size_t end = list.find(',', start);
+                if (end == std::string::npos) {
+                    end = list.size();
+                }
+                shard_config.cpus.push_back(std::stoi(list.substr(start, end - start)));
+                start = end + 1;
+            }
+        }
+    }
+
+    if (!record_path.empty() && !journal_dir.empty()) {
+        std::fprintf(stderr, "--record and --journal cannot be combined\n");
+        return 1;
+    }
+
+    TextExecutionPrinter printer;
+    ExecutionReporter reporter;
+    reporter.add_listener(&printer);
+    std::unique_ptr<OrderLogWriter> record_log;
+    OrderLogSink* order_log = nullptr;
+    if (!record_path.empty()) {
+        try {
+            record_log.reset(new OrderLogWriter(record_path));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        order_log = record_log.get();
+    }
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+    std::unique_ptr<Journal> journal;
+    if (!journal_dir.empty()) {
+        Journal::Config journal_config;
+        journal_config.directory = journal_dir;
+        try {
+            journal.reset(new Journal(journal_config));
+        } catch (const std::exception& e) {
+            std::fprintf(stderr, "%s\n", e.what());
+            return 1;
+        }
+        order_log = journal.get();
+    }
+#endif
+    reporter.start();
+
+    std::vector<std::thread> threads;
+    bool snapshot_failed = false;
+    if (sharded) {
+        ShardedEngine engine(shard_config);
+        engine.print_placement(std::cout);
+        engine.set_execution_reporter(&reporter);
+        engine.set_order_log(order_log);
+        engine.start();
+        MetricsExporter<ShardedEngine> exporter(engine, std::cerr, std::chrono::seconds(1));
+        if (metrics) {
+            exporter.start();
+        }
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back(simulate_market_activity<ShardedEngine>, std::ref(engine), 500);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        engine.stop();
+        exporter.stop();
+        if (metrics) {
+            engine.print_metrics(std::cerr);
+        }
+    } else {
+        order_book.set_execution_reporter(&reporter);
+        order_book.set_order_log(order_log);
+        MetricsExporter<OrderBook<>> exporter(order_book, std::cerr, std::chrono::seconds(1));
+        if (metrics) {
+            exporter.start();
+        }
+        for (int i = 0; i < 4; i++) {
+            threads.emplace_back(simulate_market_activity<OrderBook<>>, std::ref(order_book), 500);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        exporter.stop();
+        if (metrics) {
+            order_book.print_metrics(std::cerr);
+        }
+        if (!snapshot_path.empty()) {
+            try {
+                order_book.snapshot(snapshot_path);
+            } catch (const std::exception& e) {
+                std::fprintf(stderr, "%s\n", e.what());
+                snapshot_failed = true;
+            }
+        }
+    }
+    if (record_log) {
+        record_log->close();
+        if (record_log->failed()) {
+            std::fprintf(stderr, "order log %s is incomplete: %s\n", record_path.c_str(), std::strerror(record_log->error()));
+        }
+    }
+    reporter.stop();
+    int status = (record_log && record_log->failed()) || snapshot_failed ? 1 : 0;
+#ifdef STOCK_ENGINE_HAS_POSIX_IO
+    if (journal) {
+        journal->close();
+        if (journal->failed()) {
+            std::fprintf(stderr, "journal failed after sequence %llu: %s\n",
+                         static_cast<unsigned long long>(journal->durable_sequence()), std::strerror(journal->error()));
+            status = 1;
+        }
+    }
+#endif
+    return status;
 }
\ No newline at end of file